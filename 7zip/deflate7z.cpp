@@ -78,6 +78,26 @@ class COutBlockStream:
 	uint32_t pos_;
 };
 
+// Stops compression as soon as a finished block goes over the size limit.
+class CProgressLimit:
+  public ICompressProgressInfo,
+  public CMyUnknownImp
+{
+public:
+	virtual ~CProgressLimit() {
+	}
+
+	void Init(uint32_t limit) {
+		limit_ = limit;
+	}
+
+	MY_UNKNOWN_IMP1(ICompressProgressInfo)
+	STDMETHOD(SetRatioInfo)(const UInt64 *inSize, const UInt64 *outSize);
+
+private:
+	uint32_t limit_;
+};
+
 void CInBlockStream::Init(const void *buffer, uint32_t size) {
 	buffer_ = reinterpret_cast<const uint8_t *>(buffer);
 	size_ = size;
@@ -103,11 +123,9 @@ HRESULT CInBlockStream::Read(void *data, UInt32 size, UInt32 *processedSize) {
 }
 
 HRESULT COutBlockStream::Write(const void *data, UInt32 size, UInt32 *processedSize) {
+	// Writing only part would look like success if it was the last write, so fail instead.
 	if (pos_ + size > size_) {
-		size = size_ - pos_;
-	}
-	if (size == 0) {
-		*processedSize = size;
+		*processedSize = 0;
 		return E_FAIL;
 	}
 	memcpy(buffer_ + pos_, data, size);
@@ -116,9 +134,17 @@ HRESULT COutBlockStream::Write(const void *data, UInt32 size, UInt32 *processedS
 	return S_OK;
 }
 
+HRESULT CProgressLimit::SetRatioInfo(const UInt64 *inSize, const UInt64 *outSize) {
+	if (outSize != NULL && *outSize > limit_) {
+		return E_ABORT;
+	}
+	return S_OK;
+}
+
 struct Context {
 	CInBlockStream *in;
 	COutBlockStream *out;
+	CProgressLimit *progress;
 	ICompressCoder *coder;
 };
 
@@ -148,8 +174,10 @@ void Alloc(Context **ctx, const Options *opts) {
 
 	c->in = new CInBlockStream();
 	c->out = new COutBlockStream();
+	c->progress = new CProgressLimit();
 	c->in->AddRef();
 	c->out->AddRef();
+	c->progress->AddRef();
 
 	if (opts->useZlib) {
 		NCompress::NZlib::CEncoder *coder = new NCompress::NZlib::CEncoder();
@@ -168,6 +196,7 @@ void Release(Context **ctx) {
 
 	c->in->Release();
 	c->out->Release();
+	c->progress->Release();
 	delete c->coder;
 
 	delete *ctx;
@@ -177,8 +206,9 @@ void Release(Context **ctx) {
 bool Deflate(Context *ctx, void *dst, uint32_t dstSize, const void *src, uint32_t srcSize, uint32_t *resultSize) {
 	ctx->in->Init(src, srcSize);
 	ctx->out->Init(dst, dstSize);
+	ctx->progress->Init(dstSize);
 
-	if (ctx->coder->Code(ctx->in, ctx->out, NULL, NULL, NULL) == SZ_OK) {
+	if (ctx->coder->Code(ctx->in, ctx->out, NULL, NULL, ctx->progress) == SZ_OK) {
 		*resultSize = ctx->out->DataSize();
 		return true;
 	}
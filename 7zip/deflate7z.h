@@ -18,7 +18,7 @@ namespace Deflate7z {
 	void SetDefaults(Options *opts);
 	bool Deflate(const Options *opts, void *dst, uint32_t dstSize, const void *src, uint32_t srcSize, uint32_t *resultSize);
 
-	// For repeated use.
+	// For repeated use.  Fails early once the output can't fit in dstSize.
 	void Alloc(Context **ctx, const Options *opts);
 	bool Deflate(Context *ctx, void *dst, uint32_t dstSize, const void *src, uint32_t srcSize, uint32_t *resultSize);
 	void Release(Context **ctx);
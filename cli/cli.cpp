@@ -3,6 +3,7 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <map>
 #include <string>
 #include <vector>
 #ifndef _WIN32
@@ -24,7 +25,15 @@ void show_help(const char *arg0) {
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Multiple files may be specified.  Inputs can be iso or cso files.\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "   --threads=N      Specify N threads for I/O and compression\n");
+	fprintf(stderr, "   --threads=N      Specify N threads for compression\n");
+	fprintf(stderr, "   --parallel=N     Process up to N files at the same time (default 1)\n");
+	fprintf(stderr, "   --read-ahead=N   Keep up to N reads of input in flight (default %d)\n", maxcso::DEFAULT_READ_AHEAD);
+	fprintf(stderr, "   --read-size=N    Read input N KB at a time (default %d, ISOs up to 1024 blocks)\n", maxcso::DEFAULT_READ_SIZE / 1024);
+	fprintf(stderr, "   --mmap           Map input files into memory instead of reading them\n");
+	fprintf(stderr, "   --io-uring       Read and write files using io_uring (Linux only)\n");
+	fprintf(stderr, "   --drop-cache     Keep file data out of the OS cache once used\n");
+	fprintf(stderr, "   --split-trials   Run each method as a separate job, faster with slow methods\n");
+	fprintf(stderr, "   --adaptive       Run methods that rarely win on only some blocks (faster)\n");
 	fprintf(stderr, "   --quiet          Suppress status output\n");
 	fprintf(stderr, "   --crc            Log CRC32 checksums, ignore output files and methods\n");
 	fprintf(stderr, "   --measure        Measure compressed size without saving output\n");
@@ -34,8 +43,12 @@ void show_help(const char *arg0) {
 	fprintf(stderr, "                    Many readers only support the 2048 size\n");
 	fprintf(stderr, "   --format=VER     Specify cso version (options: cso1, cso2, zso, dax)\n");
 	fprintf(stderr, "                    These are experimental, default is cso1\n");
-	// TODO: Bring this back once it's functional.
-	//fprintf(stderr, "   --smallest       Force compression of all sectors for smallest result\n");
+	fprintf(stderr, "   --smallest       Force compression of all sectors for smallest result\n");
+	fprintf(stderr, "   --dedup=N        Reuse results for repeated blocks, up to N MB (default %d, 0=off)\n", maxcso::DEFAULT_CACHE_SIZE);
+	fprintf(stderr, "   --cache-dir=X    Save results of each method to X/, and reuse them next time\n");
+	fprintf(stderr, "   --stats=X        Write stats for each method to file X as JSON\n");
+	fprintf(stderr, "   --stats-blocks=X Write stats for each block to file X as CSV\n");
+	fprintf(stderr, "   --skip-entropy=N Skip trials for blocks above N bits/byte (default %.1f, 8=off)\n", maxcso::DEFAULT_ENTROPY_THRESHOLD);
 	fprintf(stderr, "   --use-zlib       Enable trials with zlib for deflate compression\n");
 	fprintf(stderr, "   --use-zopfli     Enable trials with Zopfli for deflate compression\n");
 #ifndef NO_DEFLATE7Z
@@ -107,8 +120,15 @@ struct Arguments {
 	std::vector<std::string> inputs;
 	std::vector<std::string> outputs;
 	std::string output_path;
+	std::string cache_dir;
+	std::string stats_json;
+	std::string stats_blocks;
 	int threads;
+	int parallel;
+	int read_ahead;
+	int read_size;
 	uint32_t block_size;
+	uint32_t cache_size;
 
 	// Let's just use separate vars for each and figure out at the end.
 	// Clearer to translate the user's logic this way, with defaults.
@@ -120,6 +140,7 @@ struct Arguments {
 
 	double orig_cost_percent;
 	double lz4_cost_percent;
+	double entropy_threshold;
 
 	bool fast;
 	bool smallest;
@@ -127,11 +148,20 @@ struct Arguments {
 	bool crc;
 	bool decompress;
 	bool measure;
+	bool split_trials;
+	bool adaptive;
+	bool mmap;
+	bool io_uring;
+	bool drop_cache;
 };
 
 void default_args(Arguments &args) {
 	args.threads = 0;
+	args.parallel = 1;
+	args.read_ahead = maxcso::DEFAULT_READ_AHEAD;
+	args.read_size = maxcso::DEFAULT_READ_SIZE / 1024;
 	args.block_size = maxcso::DEFAULT_BLOCK_SIZE;
+	args.cache_size = maxcso::DEFAULT_CACHE_SIZE;
 
 	args.flags_fmt = 0;
 	args.flags_use = 0;
@@ -141,6 +171,7 @@ void default_args(Arguments &args) {
 
 	args.orig_cost_percent = 0.0;
 	args.lz4_cost_percent = 0.0;
+	args.entropy_threshold = maxcso::DEFAULT_ENTROPY_THRESHOLD;
 
 	args.fast = false;
 	args.smallest = false;
@@ -148,6 +179,11 @@ void default_args(Arguments &args) {
 	args.crc = false;
 	args.decompress = false;
 	args.measure = false;
+	args.split_trials = false;
+	args.adaptive = false;
+	args.mmap = false;
+	args.io_uring = false;
+	args.drop_cache = false;
 }
 
 void wildcard_to_inputs(const char *arg, std::vector<std::string> &files) {
@@ -175,10 +211,26 @@ int parse_args(Arguments &args, int argc, char *argv[]) {
 				args.block_size = atoi(val);
 			} else if (has_arg_value(i, argv, "--threads", val)) {
 				args.threads = atoi(val);
+			} else if (has_arg_value(i, argv, "--parallel", val)) {
+				args.parallel = atoi(val);
+			} else if (has_arg_value(i, argv, "--read-ahead", val)) {
+				args.read_ahead = atoi(val);
+			} else if (has_arg_value(i, argv, "--read-size", val)) {
+				args.read_size = atoi(val);
 			} else if (has_arg_value(i, argv, "--orig-cost", val)) {
 				args.orig_cost_percent = atof(val);
 			} else if (has_arg_value(i, argv, "--lz4-cost", val)) {
 				args.lz4_cost_percent = atof(val);
+			} else if (has_arg_value(i, argv, "--dedup", val)) {
+				args.cache_size = atoi(val);
+			} else if (has_arg_value(i, argv, "--stats-blocks", val)) {
+				args.stats_blocks = val;
+			} else if (has_arg_value(i, argv, "--stats", val)) {
+				args.stats_json = val;
+			} else if (has_arg_value(i, argv, "--cache-dir", val)) {
+				args.cache_dir = val;
+			} else if (has_arg_value(i, argv, "--skip-entropy", val)) {
+				args.entropy_threshold = atof(val);
 			} else if (has_arg_value(i, argv, "--format", val)) {
 				if (strcmp(val, "cso1") == 0) {
 					args.flags_fmt = 0;
@@ -205,6 +257,16 @@ int parse_args(Arguments &args, int argc, char *argv[]) {
 				args.decompress = true;
 			} else if (has_arg(i, argv, "--measure")) {
 				args.measure = true;
+			} else if (has_arg(i, argv, "--split-trials")) {
+				args.split_trials = true;
+			} else if (has_arg(i, argv, "--adaptive")) {
+				args.adaptive = true;
+			} else if (has_arg(i, argv, "--mmap")) {
+				args.mmap = true;
+			} else if (has_arg(i, argv, "--io-uring")) {
+				args.io_uring = true;
+			} else if (has_arg(i, argv, "--drop-cache")) {
+				args.drop_cache = true;
 			} else if (has_arg_method(i, argv, "--use-", method)) {
 				args.flags_use |= method;
 			} else if (has_arg_method(i, argv, "--no-", method)) {
@@ -261,6 +323,18 @@ int validate_args(const char *arg0, Arguments &args) {
 		uv_free_cpu_info(cpus, args.threads);
 	}
 
+	if (args.parallel < 1) {
+		show_help(arg0);
+		fprintf(stderr, "\nERROR: Must process at least one file at a time.\n");
+		return 1;
+	}
+
+	if (args.read_ahead < 1 || args.read_size < 1) {
+		show_help(arg0);
+		fprintf(stderr, "\nERROR: Must read at least 1 KB at a time, with at least one read.\n");
+		return 1;
+	}
+
 	if (args.inputs.size() < args.outputs.size()) {
 		show_help(arg0);
 		fprintf(stderr, "\nERROR: Too many output files.\n");
@@ -356,6 +430,12 @@ int validate_args(const char *arg0, Arguments &args) {
 	if (args.measure) {
 		args.flags_final |= maxcso::TASKFLAG_MEASURE;
 	}
+	if (args.split_trials) {
+		args.flags_final |= maxcso::TASKFLAG_SPLIT_TRIALS;
+	}
+	if (args.adaptive) {
+		args.flags_final |= maxcso::TASKFLAG_ADAPTIVE_TRIALS;
+	}
 	args.flags_final |= args.flags_fmt;
 
 	if (args.flags_fmt & maxcso::TASKFLAG_FMT_DAX) {
@@ -378,12 +458,6 @@ int validate_args(const char *arg0, Arguments &args) {
 	return 0;
 }
 
-#ifdef _WIN32
-int setenv(const char *name, const char *value, int) {
-	return _putenv_s(name, value);
-}
-#endif
-
 inline uv_buf_t uv_buf_init(const char *str) {
 	return uv_buf_init(const_cast<char *>(str), static_cast<unsigned int>(strlen(str)));
 }
@@ -394,10 +468,114 @@ inline uv_buf_t uv_buf_init(const std::string &str) {
 
 const std::string ANSI_RESET_LINE = "\033[2K\033[0G";
 
-void update_threadpool(const Arguments &args) {
-	char threadpool_size[32];
-	sprintf(threadpool_size, "%d", args.threads);
-	setenv("UV_THREADPOOL_SIZE", threadpool_size, 1);
+std::string json_escape(const std::string &str) {
+	std::string result;
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			result += '\\';
+			result += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char temp[8];
+			sprintf(temp, "\\u%04x", c);
+			result += temp;
+		} else {
+			result += c;
+		}
+	}
+	return result;
+}
+
+void add_stats(maxcso::TaskStats &total, const maxcso::TaskStats &stats) {
+	total.blocks += stats.blocks;
+	total.blocks_skipped += stats.blocks_skipped;
+	total.blocks_filled += stats.blocks_filled;
+	total.blocks_cached += stats.blocks_cached;
+	total.trials_known += stats.trials_known;
+	total.input_decompressed += stats.input_decompressed;
+	for (int m = 0; m < maxcso::TRIAL_METHOD_COUNT; ++m) {
+		maxcso::MethodStats &method = total.methods[m];
+		method.trials += stats.methods[m].trials;
+		method.pruned += stats.methods[m].pruned;
+		method.wins += stats.methods[m].wins;
+		method.bytes_saved += stats.methods[m].bytes_saved;
+		method.cpu_ns += stats.methods[m].cpu_ns;
+		for (int i = 0; i < maxcso::STATS_RATIO_BUCKETS; ++i) {
+			method.ratios[i] += stats.methods[m].ratios[i];
+		}
+	}
+}
+
+void write_stats_json(FILE *fp, const maxcso::TaskStats &stats, const char *indent) {
+	fprintf(fp, "{\n");
+	fprintf(fp, "%s  \"blocks\": %" PRId64 ",\n", indent, stats.blocks);
+	fprintf(fp, "%s  \"blocks_skipped\": %" PRId64 ",\n", indent, stats.blocks_skipped);
+	fprintf(fp, "%s  \"blocks_filled\": %" PRId64 ",\n", indent, stats.blocks_filled);
+	fprintf(fp, "%s  \"blocks_cached\": %" PRId64 ",\n", indent, stats.blocks_cached);
+	fprintf(fp, "%s  \"trials_known\": %" PRId64 ",\n", indent, stats.trials_known);
+	fprintf(fp, "%s  \"input_decompressed\": %" PRId64 ",\n", indent, stats.input_decompressed);
+	fprintf(fp, "%s  \"methods\": {", indent);
+	bool first = true;
+	for (int m = 0; m < maxcso::TRIAL_METHOD_COUNT; ++m) {
+		const maxcso::MethodStats &method = stats.methods[m];
+		if (method.trials == 0 && method.pruned == 0) {
+			continue;
+		}
+
+		fprintf(fp, "%s\n%s    \"%s\": { ", first ? "" : ",", indent, maxcso::TrialMethodName(static_cast<maxcso::TrialMethod>(m)));
+		fprintf(fp, "\"trials\": %" PRId64 ", \"pruned\": %" PRId64 ", \"wins\": %" PRId64 ", \"bytes_saved\": %" PRId64 ", \"cpu_ns\": %" PRIu64 ", \"ratios\": [", method.trials, method.pruned, method.wins, method.bytes_saved, method.cpu_ns);
+		for (int i = 0; i < maxcso::STATS_RATIO_BUCKETS; ++i) {
+			fprintf(fp, "%s%" PRId64, i == 0 ? "" : ", ", method.ratios[i]);
+		}
+		fprintf(fp, "] }");
+		first = false;
+	}
+	fprintf(fp, "\n%s  }\n%s}", indent, indent);
+}
+
+bool write_all_stats_json(const std::string &filename, const std::vector<std::pair<std::string, maxcso::TaskStats>> &all) {
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if (!fp) {
+		return false;
+	}
+
+	maxcso::TaskStats total = {};
+	fprintf(fp, "{\n  \"tasks\": [");
+	for (size_t i = 0; i < all.size(); ++i) {
+		fprintf(fp, "%s\n    { \"input\": \"%s\", \"stats\": ", i == 0 ? "" : ",", json_escape(all[i].first).c_str());
+		write_stats_json(fp, all[i].second, "    ");
+		fprintf(fp, " }");
+		add_stats(total, all[i].second);
+	}
+	fprintf(fp, "\n  ],\n  \"total\": ");
+	write_stats_json(fp, total, "  ");
+	fprintf(fp, "\n}\n");
+	return fclose(fp) == 0;
+}
+
+void write_block_stats_header(FILE *fp) {
+	fprintf(fp, "input,pos,size,compressed,skipped,filled,cached,winner");
+	for (int m = 0; m < maxcso::TRIAL_METHOD_COUNT; ++m) {
+		const char *name = maxcso::TrialMethodName(static_cast<maxcso::TrialMethod>(m));
+		fprintf(fp, ",%s_size,%s_ns", name, name);
+	}
+	fprintf(fp, "\n");
+}
+
+void write_block_stats(FILE *fp, const std::string &input, const maxcso::BlockStats &stats) {
+	std::string quoted = input;
+	for (size_t i = quoted.find('"'); i != quoted.npos; i = quoted.find('"', i + 2)) {
+		quoted.insert(i, 1, '"');
+	}
+	const char *winner = stats.winner < 0 ? "" : maxcso::TrialMethodName(static_cast<maxcso::TrialMethod>(stats.winner));
+	fprintf(fp, "\"%s\",%" PRId64 ",%u,%d,%d,%d,%d,%s", quoted.c_str(), stats.pos, stats.size, stats.compressed, stats.skipped, stats.filled, stats.cached, winner);
+	for (int m = 0; m < maxcso::TRIAL_METHOD_COUNT; ++m) {
+		if (stats.trial_sizes[m] < 0) {
+			fprintf(fp, ",,");
+		} else {
+			fprintf(fp, ",%d,%" PRIu64, stats.trial_sizes[m], stats.trial_ns[m]);
+		}
+	}
+	fprintf(fp, "\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -416,7 +594,15 @@ int main(int argc, char *argv[]) {
 		return result;
 	}
 
-	update_threadpool(args);
+	FILE *blockStatsFile = nullptr;
+	if (!args.stats_blocks.empty()) {
+		blockStatsFile = fopen(args.stats_blocks.c_str(), "wb");
+		if (!blockStatsFile) {
+			fprintf(stderr, "ERROR: Could not open %s for writing.\n", args.stats_blocks.c_str());
+			return 1;
+		}
+		write_block_stats_header(blockStatsFile);
+	}
 
 	uv_loop_t loop;
 	uv_tty_t tty;
@@ -425,15 +611,19 @@ int main(int argc, char *argv[]) {
 	uv_tty_set_mode(&tty, 0);
 	bool formatting = uv_guess_handle(2) == UV_TTY && !args.quiet;
 
-	int64_t next = uv_hrtime();
 	// 50ms
 	static const int64_t interval_ns = 50000000LL;
 	static const double b_to_mb = 1.0 / (1024 * 1024);
 	static const double ns_to_s = 1.0 / (1000 * 1000 * 1000);
-	struct History { int64_t pos, time; } history[20]; // 50ms * 20 = 1s
-	constexpr int historyLen = sizeof(history) / sizeof(*history);
-	int historyPos = 0;
-	std::fill(std::begin(history), std::end(history), History{0, next});
+	struct History { int64_t pos, time; };
+	static const int historyLen = 20; // 50ms * 20 = 1s
+	// Tasks may run in parallel, so each tracks its own speed.
+	struct Progress {
+		int64_t next;
+		int historyPos;
+		History history[historyLen];
+	};
+	std::map<const maxcso::Task *, Progress> progressByTask;
 
 	std::string statusInfo;
 	uv_write_t write_req;
@@ -451,10 +641,19 @@ int main(int argc, char *argv[]) {
 
 		if (status == maxcso::TASK_INPROGRESS) {
 			int64_t now = uv_hrtime();
-			if (now >= next) {
+			auto found = progressByTask.find(task);
+			if (found == progressByTask.end()) {
+				Progress fresh;
+				fresh.next = now;
+				fresh.historyPos = 0;
+				std::fill(std::begin(fresh.history), std::end(fresh.history), History{0, now});
+				found = progressByTask.insert(std::make_pair(task, fresh)).first;
+			}
+			Progress &state = found->second;
+			if (now >= state.next) {
 				double percent = total == 0 ? 0.0 : (pos * 100.0) / total;
 				double ratio = pos == 0 ? 0.0 : (written * 100.0) / pos;
-				History &entry = history[historyPos];
+				History &entry = state.history[state.historyPos];
 				int64_t diff = pos - entry.pos;
 				int64_t elapsed = now - entry.time;
 				entry = {pos, now};
@@ -464,19 +663,21 @@ int main(int argc, char *argv[]) {
 				sprintf(temp, "%3.0f%%, ratio=%3.0f%%, speed=%5.2f MB/s", percent, ratio, speed);
 				statusInfo = temp;
 
-				next = now + interval_ns;
-				historyPos++;
-				if (historyPos >= historyLen) {
-					historyPos = 0;
+				state.next = now + interval_ns;
+				state.historyPos++;
+				if (state.historyPos >= historyLen) {
+					state.historyPos = 0;
 				}
 			}
 		} else if (status == maxcso::TASK_SUCCESS) {
+			progressByTask.erase(task);
 			double ratio = total == 0 ? 0.0 : (written * 100.0) / total;
 			char temp[128];
 			sprintf(temp, "%" PRId64 " -> %" PRId64 " bytes (%.0f%%)\n", total, written, ratio);
 			statusInfo = temp;
 		} else {
 			// This shouldn't happen.
+			progressByTask.erase(task);
 			statusInfo = "Something went wrong.\n";
 		}
 
@@ -519,6 +720,33 @@ int main(int argc, char *argv[]) {
 		}
 	};
 
+	std::vector<std::pair<std::string, maxcso::TaskStats>> allStats;
+	maxcso::StatsCallback stats = [&] (const maxcso::Task *task, const maxcso::TaskStats &stats) {
+		if (!args.stats_json.empty()) {
+			allStats.push_back(std::make_pair(task->input, stats));
+		}
+		if (stats.blocks_skipped != 0) {
+			char temp[128];
+			sprintf(temp, "skipped trials for %" PRId64 " of %" PRId64 " blocks", stats.blocks_skipped, stats.blocks);
+			error(task, maxcso::TASK_SUCCESS, temp);
+		}
+		if (stats.blocks_filled != 0) {
+			char temp[128];
+			sprintf(temp, "reused results for %" PRId64 " of %" PRId64 " blocks of padding", stats.blocks_filled, stats.blocks);
+			error(task, maxcso::TASK_SUCCESS, temp);
+		}
+		if (stats.blocks_cached != 0) {
+			char temp[128];
+			sprintf(temp, "found %" PRId64 " of %" PRId64 " blocks in dedup cache (%.1f%%)", stats.blocks_cached, stats.blocks, stats.blocks_cached * 100.0 / stats.blocks);
+			error(task, maxcso::TASK_SUCCESS, temp);
+		}
+		if (stats.trials_known != 0) {
+			char temp[128];
+			sprintf(temp, "reused %" PRId64 " trial results from cache directory", stats.trials_known);
+			error(task, maxcso::TASK_SUCCESS, temp);
+		}
+	};
+
 	std::vector<maxcso::Task> tasks;
 	for (size_t i = 0; i < args.inputs.size(); ++i) {
 		maxcso::Task task;
@@ -528,17 +756,44 @@ int main(int argc, char *argv[]) {
 		}
 		task.progress = progress;
 		task.error = error;
+		task.stats = stats;
+		if (blockStatsFile) {
+			task.block_stats = [blockStatsFile](const maxcso::Task *task, const maxcso::BlockStats &stats) {
+				write_block_stats(blockStatsFile, task->input, stats);
+			};
+		}
 		task.block_size = args.block_size;
 		task.flags = args.flags_final;
 		task.orig_max_cost_percent = args.orig_cost_percent;
 		task.lz4_max_cost_percent = args.lz4_cost_percent;
+		task.entropy_threshold = args.entropy_threshold;
 		tasks.push_back(std::move(task));
 	}
 
+	maxcso::CompressOptions options;
+	options.parallel_tasks = args.parallel;
+	options.threads = args.threads;
+	options.cache_size = static_cast<uint64_t>(args.cache_size) * 1024 * 1024;
+	options.cache_dir = args.cache_dir;
+	options.read_ahead = static_cast<uint32_t>(args.read_ahead);
+	options.read_size = static_cast<uint32_t>(args.read_size) * 1024;
+	options.use_mapping = args.mmap;
+	options.use_io_uring = args.io_uring;
+	options.drop_cache = args.drop_cache;
+
 	if (args.crc) {
-		maxcso::Checksum(tasks);
+		maxcso::Checksum(tasks, options);
 	} else {
-		maxcso::Compress(tasks);
+		maxcso::Compress(tasks, options);
+	}
+
+	if (blockStatsFile && fclose(blockStatsFile) != 0) {
+		fprintf(stderr, "ERROR: Could not write %s.\n", args.stats_blocks.c_str());
+		result = 1;
+	}
+	if (!args.stats_json.empty() && !args.crc && !write_all_stats_json(args.stats_json, allStats)) {
+		fprintf(stderr, "ERROR: Could not write %s.\n", args.stats_json.c_str());
+		result = 1;
 	}
 
 	uv_tty_reset_mode();
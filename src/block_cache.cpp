@@ -0,0 +1,76 @@
+#include <cstring>
+#include "block_cache.h"
+#include "uv_helper.h"
+// We only need the hash functions, and this keeps them out of the link.
+#define XXH_INLINE_ALL
+#include "../lz4/lib/xxhash.h"
+
+namespace maxcso {
+
+// Rough cost of the list and map nodes, so many tiny results still count.
+static const uint64_t ENTRY_OVERHEAD = 128;
+// Two different seeds give a 128 bit hash, so collisions aren't a practical worry.
+static const uint64_t SEED_1 = 0;
+static const uint64_t SEED_2 = 0x9E3779B97F4A7C15ULL;
+
+bool BlockCache::Key::operator ==(const Key &other) const {
+	return hash[0] == other.hash[0] && hash[1] == other.hash[1] && blockSize == other.blockSize && flags == other.flags &&
+		align == other.align && origMaxCost == other.origMaxCost && lz4MaxCost == other.lz4MaxCost;
+}
+
+BlockCache::BlockCache(uint64_t maxBytes) : maxBytes_(maxBytes) {
+	uv_mutex_init(&mutex_);
+}
+
+BlockCache::~BlockCache() {
+	uv_mutex_destroy(&mutex_);
+}
+
+void BlockCache::HashBlock(Key &key, const uint8_t *p, uint32_t len) {
+	key.hash[0] = XXH64(p, len, SEED_1);
+	key.hash[1] = XXH64(p, len, SEED_2);
+}
+
+uint64_t BlockCache::EntryBytes(const Entry &entry) {
+	return ENTRY_OVERHEAD + entry.data.size();
+}
+
+bool BlockCache::Lookup(const Key &key, uint8_t *dst, uint32_t &size, SectorFormat &fmt) {
+	Guard g(mutex_);
+	auto it = map_.find(key);
+	if (it == map_.end()) {
+		return false;
+	}
+
+	// Move it to the front, since it's now the most recently used.
+	entries_.splice(entries_.begin(), entries_, it->second);
+	const Entry &entry = *it->second;
+	size = static_cast<uint32_t>(entry.data.size());
+	fmt = entry.fmt;
+	if (size != 0) {
+		memcpy(dst, entry.data.data(), size);
+	}
+	return true;
+}
+
+void BlockCache::Insert(const Key &key, const uint8_t *data, uint32_t size, SectorFormat fmt) {
+	Guard g(mutex_);
+	if (map_.find(key) != map_.end()) {
+		// Another task beat us to it, it should be the same anyway.
+		return;
+	}
+
+	entries_.push_front(Entry{ key, fmt, std::vector<uint8_t>(data, data + size) });
+	map_[key] = entries_.begin();
+	bytes_ += EntryBytes(entries_.front());
+
+	// Evict the least recently used until we're under the limit.
+	while (bytes_ > maxBytes_ && !entries_.empty()) {
+		const Entry &oldest = entries_.back();
+		bytes_ -= EntryBytes(oldest);
+		map_.erase(oldest.key);
+		entries_.pop_back();
+	}
+}
+
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "uv.h"
+#include "cso.h"
+
+namespace maxcso {
+
+// Remembers the best result for blocks we've already compressed, shared by all tasks.
+// Multi-disc games and regional variants often have many identical blocks.
+class BlockCache {
+public:
+	// Anything that changes the result has to be part of the key.
+	struct Key {
+		uint64_t hash[2];
+		uint32_t blockSize;
+		uint32_t flags;
+		uint32_t align;
+		uint32_t origMaxCost;
+		uint32_t lz4MaxCost;
+
+		bool operator ==(const Key &other) const;
+	};
+
+	// A maxBytes of 0 disables the cache.
+	BlockCache(uint64_t maxBytes);
+	~BlockCache();
+
+	bool Enabled() {
+		return maxBytes_ != 0;
+	}
+
+	static void HashBlock(Key &key, const uint8_t *p, uint32_t len);
+
+	// Safe from any thread.  If found, copies the result to dst (which must be large enough.)
+	bool Lookup(const Key &key, uint8_t *dst, uint32_t &size, SectorFormat &fmt);
+	// Uncompressed results use a null data and a size of 0.
+	void Insert(const Key &key, const uint8_t *data, uint32_t size, SectorFormat fmt);
+
+private:
+	struct KeyHasher {
+		size_t operator ()(const Key &key) const {
+			return static_cast<size_t>(key.hash[0]);
+		}
+	};
+	struct Entry {
+		Key key;
+		SectorFormat fmt;
+		std::vector<uint8_t> data;
+	};
+	typedef std::list<Entry> EntryList;
+
+	static uint64_t EntryBytes(const Entry &entry);
+
+	uint64_t maxBytes_;
+
+	// Protected by mutex_.  Most recently used first.
+	uv_mutex_t mutex_;
+	EntryList entries_;
+	std::unordered_map<Key, EntryList::iterator, KeyHasher> map_;
+	uint64_t bytes_ = 0;
+};
+
+};
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include "buffer_pool.h"
 #include "uv_helper.h"
@@ -5,8 +6,43 @@
 namespace maxcso {
 
 static const uint32_t MIN_SIZE = 16384;
+// We keep the size of each buffer in front of it, so older sizes can be retired on release.
+// This is 16 to keep the buffer itself aligned well.
+static const size_t HEADER_SIZE = 16;
+// Buffers start on a cache line, so threads don't share lines between neighbors.
+static const size_t ALIGN = 64;
+// Buffers are carved from slabs of about this size, rather than allocated one at a time.
+static const size_t SLAB_SIZE = 1024 * 1024;
+// Each thread keeps up to CACHE_MAX free buffers, and moves CACHE_BATCH at a time.
+static const size_t CACHE_MAX = 16;
+static const size_t CACHE_BATCH = 8;
 
-BufferPool::BufferPool() : bufferSize(MIN_SIZE), allocations_(0) {
+struct BufferSlab {
+	uint8_t *mem;
+	// Buffers not yet retired, whether free or in use.  Protected by mutex_.
+	size_t live;
+};
+
+struct BufferHeader {
+	BufferSlab *slab;
+	uint32_t size;
+};
+
+static_assert(sizeof(BufferHeader) <= HEADER_SIZE, "Buffer header must fit");
+
+static inline BufferHeader &HeaderOf(uint8_t *p) {
+	return *reinterpret_cast<BufferHeader *>(p - HEADER_SIZE);
+}
+
+thread_local BufferPool::ThreadCache BufferPool::threadCache_;
+
+BufferPool::ThreadCache::~ThreadCache() {
+	if (owner != nullptr) {
+		owner->Detach(*this);
+	}
+}
+
+BufferPool::BufferPool() : bufferSize_(MIN_SIZE), detachedInUse_(0) {
 	uv_mutex_init(&mutex_);
 }
 
@@ -15,43 +51,164 @@ BufferPool::~BufferPool() {
 	uv_mutex_destroy(&mutex_);
 }
 
+BufferPool::ThreadCache &BufferPool::Cache() {
+	ThreadCache &cache = threadCache_;
+	if (cache.owner != this) {
+		if (cache.owner != nullptr) {
+			cache.owner->Detach(cache);
+		}
+		Guard g(mutex_);
+		cache.owner = this;
+		caches_.push_back(&cache);
+	}
+	return cache;
+}
+
+void BufferPool::Detach(ThreadCache &cache) {
+	Guard g(mutex_);
+	const uint32_t size = BufferSize();
+	for (uint8_t *p : cache.free) {
+		if (HeaderOf(p).size == size) {
+			free_.push_back(p);
+		} else {
+			Retire(p);
+		}
+	}
+	cache.free.clear();
+
+	// Buffers may be released on a different thread than they were allocated, so keep the count.
+	detachedInUse_ += cache.inUse.exchange(0);
+	caches_.erase(std::remove(caches_.begin(), caches_.end(), &cache), caches_.end());
+	cache.owner = nullptr;
+}
+
+void BufferPool::Refill(ThreadCache &cache) {
+	Guard g(mutex_);
+	const uint32_t size = BufferSize();
+	while (cache.free.size() < CACHE_BATCH) {
+		if (free_.empty()) {
+			Carve();
+		}
+		uint8_t *p = free_.back();
+		free_.pop_back();
+		if (HeaderOf(p).size == size) {
+			cache.free.push_back(p);
+		} else {
+			Retire(p);
+		}
+	}
+}
+
+void BufferPool::Spill(ThreadCache &cache, size_t keep) {
+	Guard g(mutex_);
+	const uint32_t size = BufferSize();
+	while (cache.free.size() > keep) {
+		uint8_t *p = cache.free.back();
+		cache.free.pop_back();
+		if (HeaderOf(p).size == size) {
+			free_.push_back(p);
+		} else {
+			Retire(p);
+		}
+	}
+}
+
+void BufferPool::Carve() {
+	const uint32_t size = BufferSize();
+	const size_t stride = ALIGN + ((size + ALIGN - 1) & ~(ALIGN - 1));
+	const size_t count = std::max(static_cast<size_t>(1), SLAB_SIZE / stride);
+
+	BufferSlab *slab = new BufferSlab;
+	slab->mem = static_cast<uint8_t *>(malloc(count * stride + ALIGN));
+	slab->live = count;
+
+	const uintptr_t start = reinterpret_cast<uintptr_t>(slab->mem);
+	uint8_t *base = slab->mem + ((ALIGN - (start & (ALIGN - 1))) & (ALIGN - 1));
+	for (size_t i = 0; i < count; ++i) {
+		uint8_t *p = base + i * stride + ALIGN;
+		HeaderOf(p) = BufferHeader{ slab, size };
+		free_.push_back(p);
+	}
+}
+
+void BufferPool::Retire(uint8_t *p) {
+	BufferSlab *slab = HeaderOf(p).slab;
+	if (--slab->live == 0) {
+		free(slab->mem);
+		delete slab;
+	}
+}
+
 void BufferPool::Clear() {
 	for (uint8_t *p : free_) {
-		free(p);
+		Retire(p);
 	}
-	allocations_ -= free_.size();
 	free_.clear();
 }
 
-bool BufferPool::SetBufferSize(uint32_t newSize) {
-	Guard g(mutex_);
+void BufferPool::SetBufferSize(uint32_t newSize) {
 	if (newSize < MIN_SIZE) {
 		newSize = MIN_SIZE;
 	}
-	Clear();
+	if (newSize == BufferSize()) {
+		return;
+	}
 
-	// Only if there are no buffers "in the wind" can this work.
-	if (allocations_ == 0) {
-		bufferSize = newSize;
-		return true;
+	// Hand back our own spares, so they don't count against shrinking.
+	Spill(Cache(), 0);
+
+	Guard g(mutex_);
+	int64_t inUse = detachedInUse_;
+	for (ThreadCache *cache : caches_) {
+		inUse += cache->inUse.load(std::memory_order_relaxed);
+	}
+
+	// Someone may still be using the larger size (i.e. another task), so only shrink if idle.
+	// Larger buffers are always safe to use, they just waste a bit of memory.
+	// Other threads retire their spares of the old size as they come across them.
+	if (newSize > BufferSize() || inUse == 0) {
+		bufferSize_.store(newSize, std::memory_order_relaxed);
+		Clear();
 	}
-	return false;
 }
 
 uint8_t *BufferPool::Alloc() {
-	Guard g(mutex_);
-	if (free_.empty()) {
-		++allocations_;
-		return static_cast<uint8_t *>(malloc(bufferSize));
+	ThreadCache &cache = Cache();
+	for (;;) {
+		if (cache.free.empty()) {
+			Refill(cache);
+		}
+		uint8_t *p = cache.free.back();
+		cache.free.pop_back();
+		if (HeaderOf(p).size == BufferSize()) {
+			cache.inUse.fetch_add(1, std::memory_order_relaxed);
+			return p;
+		}
+
+		// From before a resize, this one is no longer useful.
+		Guard g(mutex_);
+		Retire(p);
 	}
-	uint8_t *p = free_.back();
-	free_.pop_back();
-	return p;
+}
+
+uint32_t BufferPool::SizeOf(uint8_t *p) {
+	return HeaderOf(p).size;
 }
 
 void BufferPool::Release(uint8_t *p) {
-	Guard g(mutex_);
-	free_.push_back(p);
+	ThreadCache &cache = Cache();
+	cache.inUse.fetch_sub(1, std::memory_order_relaxed);
+	if (HeaderOf(p).size != BufferSize()) {
+		// From before a resize, this one is no longer useful.
+		Guard g(mutex_);
+		Retire(p);
+		return;
+	}
+
+	cache.free.push_back(p);
+	if (cache.free.size() > CACHE_MAX) {
+		Spill(cache, CACHE_BATCH);
+	}
 }
 
 BufferPool pool;
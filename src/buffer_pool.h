@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <vector>
 #include "uv.h"
@@ -11,21 +12,49 @@ namespace maxcso {
 // our block size.  We also decompress DAX 8KB buffers, so we need at least that much.
 class BufferPool {
 public:
-	uint32_t bufferSize;
-	
 	BufferPool();
 	~BufferPool();
 
-	bool SetBufferSize(uint32_t newSize);
+	// Growing always works, even with buffers out.  Those are freed as they come back.
+	// Shrinking only happens once nothing is using the larger size anymore.
+	void SetBufferSize(uint32_t newSize);
 	uint8_t *Alloc();
 	void Release(uint8_t *p);
+	// The size of buffers from Alloc().  Any thread may read it, but it may change at any time.
+	uint32_t BufferSize() const {
+		return bufferSize_.load(std::memory_order_relaxed);
+	}
+	// How large p really is.  Unlike BufferSize(), this never changes, so it's safe from any thread.
+	static uint32_t SizeOf(uint8_t *p);
 
 private:
+	// Each thread keeps a few free buffers, and only locks to move a batch at a time.
+	struct ThreadCache {
+		~ThreadCache();
+
+		BufferPool *owner = nullptr;
+		std::vector<uint8_t *> free;
+		// Allocs minus releases on this thread.  Only changed by this thread.
+		std::atomic<int64_t> inUse{ 0 };
+	};
+
+	ThreadCache &Cache();
+	void Detach(ThreadCache &cache);
+	void Refill(ThreadCache &cache);
+	void Spill(ThreadCache &cache, size_t keep);
+	void Carve();
+	void Retire(uint8_t *p);
 	void Clear();
 
-	size_t allocations_;
-	std::vector<uint8_t *> free_;
 	uv_mutex_t mutex_;
+	// Only changed by SetBufferSize(), with mutex_ held.
+	std::atomic<uint32_t> bufferSize_;
+	// Protected by mutex_.
+	std::vector<uint8_t *> free_;
+	std::vector<ThreadCache *> caches_;
+	int64_t detachedInUse_;
+
+	static thread_local ThreadCache threadCache_;
 };
 
 extern BufferPool pool;
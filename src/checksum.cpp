@@ -1,9 +1,11 @@
+#include <cstring>
 #include <functional>
 #include <fcntl.h>
 #include <map>
 #include "checksum.h"
 #include "uv_helper.h"
 #include "input.h"
+#include "worker_pool.h"
 #include "buffer_pool.h"
 #include "cso.h"
 #define ZLIB_CONST
@@ -13,8 +15,9 @@ namespace maxcso {
 
 class ChecksumTask {
 public:
-	ChecksumTask(uv_loop_t *loop, const Task &t)
+	ChecksumTask(uv_loop_t *loop, WorkerPool *workers, const Task &t)
 		: task_(t), loop_(loop), input_(-1), inputHandler_(loop) {
+		inputHandler_.SetWorkers(workers, static_cast<uint32_t>(2 * workers->Threads()));
 	}
 	~ChecksumTask() {
 		Cleanup();
@@ -94,7 +97,13 @@ void ChecksumTask::BeginProcessing() {
 		size_ = size;
 		Notify(TASK_INPROGRESS, 0, size, 0);
 	});
-	inputHandler_.Pipe(input_, [this](int64_t pos, uint8_t *buffer) {
+	// We never ask for mapping, but holes in sparse files share a block.  Others are ours to release.
+	inputHandler_.Pipe(input_, [this](int64_t pos, uint8_t *buffer, bool mapped) {
+		if (mapped) {
+			uint8_t *copy = pool.Alloc();
+			memcpy(copy, buffer, SECTOR_SIZE);
+			buffer = copy;
+		}
 		// In case we allow the buffers to come out of order, let's use a queue.
 		if (pos_ == pos) {
 			HandleBuffer(buffer);
@@ -139,14 +148,20 @@ void ChecksumTask::HandleBuffer(uint8_t *buffer) {
 	}
 }
 
-void Checksum(const std::vector<Task> &tasks) {
+void Checksum(const std::vector<Task> &tasks, const CompressOptions &options) {
 	uv_loop_t loop;
 	uv_loop_init(&loop);
 
-	for (const Task &t : tasks) {
-		ChecksumTask task(&loop, t);
-		task.Enqueue();
-		uv_run(&loop, UV_RUN_DEFAULT);
+	{
+		// Decompressing the input is the slow part, so spread it out.
+		WorkerPool workers(&loop);
+		workers.Start(options.threads);
+
+		for (const Task &t : tasks) {
+			ChecksumTask task(&loop, &workers, t);
+			task.Enqueue();
+			uv_run(&loop, UV_RUN_DEFAULT);
+		}
 	}
 
 	// Run any remaining events from destructors.
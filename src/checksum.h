@@ -8,6 +8,7 @@
 
 namespace maxcso {
 
-void Checksum(const std::vector<Task> &tasks);
+// Only uses the thread count from options.
+void Checksum(const std::vector<Task> &tasks, const CompressOptions &options);
 
 };
@@ -0,0 +1,164 @@
+#include <cstdlib>
+#include "codecs.h"
+#include "buffer_pool.h"
+#include "libdeflate.h"
+#ifndef NO_DEFLATE7Z
+#include "deflate7z.h"
+#endif
+#define ZLIB_CONST
+#include "zlib.h"
+
+namespace maxcso {
+
+static const int ZLIB_STRATEGIES[4] = {
+	Z_DEFAULT_STRATEGY,
+	Z_FILTERED,
+	Z_HUFFMAN_ONLY,
+	Z_RLE,
+};
+
+static z_stream *InitZlib(int strategy, bool withHeader) {
+	z_stream *z = reinterpret_cast<z_stream *>(calloc(1, sizeof(z_stream)));
+	int result = deflateInit2(z, 9, Z_DEFLATED, withHeader ? 15 : -15, 9, strategy);
+	if (result != Z_OK) {
+		free(z);
+		return nullptr;
+	}
+
+	return z;
+}
+
+static void EndZlib(z_stream *&z) {
+	deflateEnd(z);
+	free(z);
+	z = nullptr;
+}
+
+static z_stream *InitInflate(bool withHeader) {
+	z_stream *z = reinterpret_cast<z_stream *>(calloc(1, sizeof(z_stream)));
+	if (inflateInit2(z, withHeader ? 15 : -15) != Z_OK) {
+		free(z);
+		return nullptr;
+	}
+
+	return z;
+}
+
+Codecs::Codecs() {
+}
+
+Codecs::~Codecs() {
+	for (auto &streams : zStreams_) {
+		for (z_stream *&z : streams) {
+			if (z != nullptr) {
+				EndZlib(z);
+			}
+		}
+	}
+
+#ifndef NO_DEFLATE7Z
+	for (Deflate7z::Context *&ctx : deflate7z_) {
+		if (ctx != nullptr) {
+			Deflate7z::Release(&ctx);
+		}
+	}
+#endif
+
+	for (z_stream *&z : inflateStreams_) {
+		if (z != nullptr) {
+			inflateEnd(z);
+			free(z);
+			z = nullptr;
+		}
+	}
+
+	if (libdeflate_ != nullptr) {
+		libdeflate_free_compressor(libdeflate_);
+	}
+	if (libdeflateDecompressor_ != nullptr) {
+		libdeflate_free_decompressor(libdeflateDecompressor_);
+	}
+
+	for (uint8_t *p : scratch_) {
+		if (p != nullptr) {
+			pool.Release(p);
+		}
+	}
+}
+
+z_stream *Codecs::Zlib(int strategy, bool withHeader) {
+	z_stream *&z = zStreams_[withHeader ? 1 : 0][strategy];
+	if (z == nullptr) {
+		z = InitZlib(ZLIB_STRATEGIES[strategy], withHeader);
+	}
+	return z;
+}
+
+Deflate7z::Context *Codecs::SevenZip(bool withHeader) {
+#ifndef NO_DEFLATE7Z
+	Deflate7z::Context *&ctx = deflate7z_[withHeader ? 1 : 0];
+	if (ctx == nullptr) {
+		Deflate7z::Options opts;
+		Deflate7z::SetDefaults(&opts);
+		opts.level = 9;
+		opts.passes = 12;
+		opts.fastbytes = 64;
+		opts.matchcycles = 32;
+		opts.algo = 1;
+		opts.useZlib = withHeader;
+		Deflate7z::Alloc(&ctx, &opts);
+	}
+	return ctx;
+#else
+	return nullptr;
+#endif
+}
+
+libdeflate_compressor *Codecs::LibDeflate() {
+	if (libdeflate_ == nullptr) {
+		libdeflate_ = libdeflate_alloc_compressor(12);
+	}
+	return libdeflate_;
+}
+
+libdeflate_decompressor *Codecs::LibDeflateDecompressor() {
+	if (libdeflateDecompressor_ == nullptr) {
+		libdeflateDecompressor_ = libdeflate_alloc_decompressor();
+	}
+	return libdeflateDecompressor_;
+}
+
+z_stream *Codecs::Inflate(bool withHeader) {
+	z_stream *&z = inflateStreams_[withHeader ? 1 : 0];
+	if (z == nullptr) {
+		z = InitInflate(withHeader);
+	} else if (inflateReset(z) != Z_OK) {
+		inflateEnd(z);
+		free(z);
+		z = InitInflate(withHeader);
+	}
+	return z;
+}
+
+uint8_t *Codecs::Scratch(TrialMethod method, uint32_t minSize) {
+	uint8_t *&p = scratch_[method];
+	// A new task may need larger buffers.  The pool's size can change at any time, so don't check it here.
+	if (p != nullptr && scratchSize_[method] < minSize) {
+		pool.Release(p);
+		p = nullptr;
+	}
+	if (p == nullptr) {
+		p = pool.Alloc();
+		scratchSize_[method] = BufferPool::SizeOf(p);
+	}
+	return p;
+}
+
+uint8_t *Codecs::TakeScratch(TrialMethod method) {
+	// Not Scratch(), since this one holds a result even if it's too small for the next block.
+	uint8_t *p = scratch_[method];
+	scratch_[method] = nullptr;
+	return p;
+}
+
+};
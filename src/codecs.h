@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include "compress.h"
+
+typedef struct z_stream_s z_stream;
+typedef struct libdeflate_compressor libdeflate_compressor;
+typedef struct libdeflate_decompressor libdeflate_decompressor;
+
+namespace Deflate7z {
+	struct Context;
+};
+
+namespace maxcso {
+
+// Compressor state for one worker thread, reused by every block it compresses.
+// Each is only created the first time it's needed, since tasks may use different formats.
+class Codecs {
+public:
+	Codecs();
+	~Codecs();
+
+	// Strategy is indexed from TRIAL_ZLIB_DEFAULT.  These return nullptr on failure.
+	z_stream *Zlib(int strategy, bool withHeader);
+	Deflate7z::Context *SevenZip(bool withHeader);
+	libdeflate_compressor *LibDeflate();
+	// For reading compressed input.  The inflate stream is reset before it's returned.
+	libdeflate_decompressor *LibDeflateDecompressor();
+	z_stream *Inflate(bool withHeader);
+
+	// Output space for each trial, reused for every block.  Take hands it off to keep.
+	// Holds at least minSize bytes, and ScratchSize() says exactly how many.
+	uint8_t *Scratch(TrialMethod method, uint32_t minSize);
+	uint32_t ScratchSize(TrialMethod method) {
+		return scratchSize_[method];
+	}
+	uint8_t *TakeScratch(TrialMethod method);
+
+private:
+	z_stream *zStreams_[2][4] = {};
+	Deflate7z::Context *deflate7z_[2] = {};
+	libdeflate_compressor *libdeflate_ = nullptr;
+	libdeflate_decompressor *libdeflateDecompressor_ = nullptr;
+	z_stream *inflateStreams_[2] = {};
+	uint8_t *scratch_[TRIAL_METHOD_COUNT] = {};
+	uint32_t scratchSize_[TRIAL_METHOD_COUNT] = {};
+};
+
+};
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <functional>
 #include <fcntl.h>
 #include "compress.h"
@@ -7,9 +8,32 @@
 #include "input.h"
 #include "output.h"
 #include "buffer_pool.h"
+#include "block_cache.h"
+#include "trial_cache.h"
+#include "worker_pool.h"
+#include "io_ring.h"
 
 namespace maxcso {
 
+const char *TrialMethodName(TrialMethod method) {
+	switch (method) {
+	case TRIAL_ZLIB_DEFAULT: return "zlib";
+	case TRIAL_ZLIB_FILTERED: return "zlib-filtered";
+	case TRIAL_ZLIB_HUFFMAN: return "zlib-huffman";
+	case TRIAL_ZLIB_RLE: return "zlib-rle";
+	case TRIAL_ZOPFLI: return "zopfli";
+	case TRIAL_7ZIP: return "7zdeflate";
+	case TRIAL_LIBDEFLATE: return "libdeflate";
+	case TRIAL_LZ4HC_4: return "lz4hc-4";
+	case TRIAL_LZ4HC_7: return "lz4hc-7";
+	case TRIAL_LZ4HC_10: return "lz4hc-10";
+	case TRIAL_LZ4HC_13: return "lz4hc-13";
+	case TRIAL_LZ4HC_16: return "lz4hc-16";
+	case TRIAL_LZ4: return "lz4";
+	default: return "unknown";
+	}
+}
+
 // Anything above this is insane.  This value is even insane.
 static const uint32_t MAX_BLOCK_SIZE = 0x40000;
 
@@ -18,17 +42,39 @@ static const uint32_t SMALL_BLOCK_SIZE = 2048;
 static const uint32_t LARGE_BLOCK_SIZE = 16384;
 // We use the LARGE_BLOCK_SIZE default for files larger than 2GB.
 static const int64_t LARGE_BLOCK_SIZE_THRESH = 0x80000000;
+// Reads and writes that can be queued at once, across all tasks, before they're submitted.
+static const uint32_t IO_RING_ENTRIES = 256;
+
+typedef std::function<void ()> InputDoneCallback;
+typedef std::function<void (bool success)> CompleteCallback;
 
 // This actually handles decompression too.  They're basically the same.
 class CompressionTask {
 public:
-	CompressionTask(uv_loop_t *loop, const Task &t)
-		: task_(t), loop_(loop), inputHandler_(loop), outputHandler_(loop, t) {
+	CompressionTask(uv_loop_t *loop, WorkerPool *workers, IoRing *ring, BlockCache *cache, TrialCache *trialCache, const Task &t, const CompressOptions &options)
+		: task_(t), loop_(loop), inputHandler_(loop), outputHandler_(loop, workers, cache, trialCache, t) {
+		inputHandler_.SetReadAhead(options.read_ahead, options.read_size);
+		inputHandler_.UseMapping(options.use_mapping);
+		inputHandler_.DropCache(options.drop_cache);
+		// Enough to keep every worker busy, with some left over while blocks are handed out.
+		inputHandler_.SetWorkers(workers, static_cast<uint32_t>(2 * workers->Threads()));
+		inputHandler_.SetRing(ring);
+		outputHandler_.SetRing(ring);
+		outputHandler_.DropCache(options.drop_cache);
 	}
 	~CompressionTask() {
 		Cleanup();
 	}
 
+	// Called once all input is read, or the task failed.  Some blocks may still be compressing.
+	void OnInputDone(InputDoneCallback callback) {
+		inputDone_ = callback;
+	}
+	// Called once the task is entirely done, successfully or not.
+	void OnComplete(CompleteCallback callback) {
+		complete_ = callback;
+	}
+
 	void Enqueue();
 	void Cleanup();
 
@@ -36,15 +82,22 @@ class CompressionTask {
 	void Notify(TaskStatus status, int64_t pos = -1, int64_t total = -1, int64_t written = -1) {
 		if (status == TASK_INPROGRESS || status == TASK_SUCCESS) {
 			task_.progress(&task_, status, pos, total, written);
+			if (status == TASK_SUCCESS) {
+				Complete(true);
+			}
 		} else {
 			task_.error(&task_, status, nullptr);
+			Complete(false);
 		}
 	}
 	void Notify(TaskStatus status, const char *reason) {
 		task_.error(&task_, status, reason);
+		Complete(status == TASK_SUCCESS);
 	}
 
 	void BeginProcessing();
+	void InputDone();
+	void Complete(bool success);
 
 	UVHelper uv_;
 	const Task &task_;
@@ -59,6 +112,11 @@ class CompressionTask {
 	uv_file output_ = -1;
 	uint32_t blockSize_= 0;
 	int64_t size_ = 0;
+
+	InputDoneCallback inputDone_;
+	CompleteCallback complete_;
+	bool inputFinished_ = false;
+	bool completed_ = false;
 };
 
 void CompressionTask::Enqueue() {
@@ -85,10 +143,7 @@ void CompressionTask::Enqueue() {
 		}
 		blockSize_ = task_.block_size;
 	}
-	if (!pool.SetBufferSize(blockSize_ * 2)) {
-		Notify(TASK_INVALID_OPTION, "Unable to update buffer size to match block size");
-		return;
-	}
+	pool.SetBufferSize(blockSize_ * 2);
 
 	// We open input and output in order in case there are errors.
 	uv_.fs_open(loop_, &read_, task_.input.c_str(), O_RDONLY, 0444, [this](uv_fs_t *req) {
@@ -134,15 +189,42 @@ void CompressionTask::Cleanup() {
 	}
 }
 
+void CompressionTask::InputDone() {
+	if (!inputFinished_) {
+		inputFinished_ = true;
+		if (inputDone_) {
+			inputDone_();
+		}
+	}
+}
+
+void CompressionTask::Complete(bool success) {
+	// Errors may be reported more than once, but we only complete once.
+	if (!completed_) {
+		completed_ = true;
+		InputDone();
+		if (complete_) {
+			complete_(success);
+		}
+	}
+}
+
 void CompressionTask::BeginProcessing() {
 	inputHandler_.OnFinish([this](bool success, const char *reason) {
 		if (!success) {
 			Notify(TASK_INVALID_DATA, reason);
+		} else {
+			InputDone();
 		}
 	});
 	outputHandler_.OnFinish([this](bool success, const char *reason) {
 		if (success) {
 			Notify(TASK_SUCCESS, size_, size_, outputHandler_.Written());
+			if (task_.stats) {
+				TaskStats stats = outputHandler_.Stats();
+				stats.input_decompressed = inputHandler_.Decompressed();
+				task_.stats(&task_, stats);
+			}
 		} else {
 			// Abort reading.
 			inputHandler_.Pause();
@@ -167,35 +249,155 @@ void CompressionTask::BeginProcessing() {
 		}
 
 		// Now that we know the file size, check if we should resize the blockSize_.
-		if (!(task_.flags & maxcso::TASKFLAG_DECOMPRESS) && task_.block_size == DEFAULT_BLOCK_SIZE && size >= LARGE_BLOCK_SIZE_THRESH) {
+		// When decompressing, the output has no blocks, so larger ones are just less overhead.
+		const bool decompressing = (task_.flags & maxcso::TASKFLAG_DECOMPRESS) != 0 && (task_.flags & maxcso::TASKFLAG_FMT_DAX) == 0;
+		if (task_.block_size == DEFAULT_BLOCK_SIZE && (decompressing || size >= LARGE_BLOCK_SIZE_THRESH)) {
 			blockSize_ = LARGE_BLOCK_SIZE;
-			if (!pool.SetBufferSize(blockSize_ * 2)) {
-				// Abort reading.
-				inputHandler_.Pause();
-				Notify(TASK_INVALID_OPTION, "Unable to update buffer size to match block size");
-				return;
+			// Input may have already grown buffers to fit its own larger blocks, so don't shrink them.
+			if (blockSize_ * 2 > pool.BufferSize()) {
+				pool.SetBufferSize(blockSize_ * 2);
 			}
 		}
 
 		outputHandler_.SetFile(output_, size, blockSize_, fmt);
+		inputHandler_.SetBlockSize(blockSize_);
 		Notify(TASK_INPROGRESS, 0, size, 0);
 		size_ = size;
 	});
-	inputHandler_.Pipe(input_, [this](int64_t pos, uint8_t *sector) {
-		outputHandler_.Enqueue(pos, sector);
+	inputHandler_.Pipe(input_, [this](int64_t pos, uint8_t *block, bool mapped) {
+		outputHandler_.Enqueue(pos, block, mapped);
 		if (outputHandler_.QueueFull()) {
 			inputHandler_.Pause();
 		}
 	});
 }
 
-void Compress(const std::vector<Task> &tasks) {
+// Runs tasks on a shared loop (and therefore threadpool), several at a time.
+// A new task starts as soon as another has read all its input, so that the pool stays busy
+// while the last blocks of a file compress, and while the next file opens and reads its index.
+// Each task can only queue a limited number of blocks, so the pool alternates between them.
+class CompressionQueue {
+public:
+	CompressionQueue(uv_loop_t *loop, WorkerPool *workers, IoRing *ring, BlockCache *cache, TrialCache *trialCache, const std::vector<Task> &tasks, const CompressOptions &options);
+	~CompressionQueue();
+
+	void Start();
+
+private:
+	void StartNext();
+	void Reap();
+
+	uv_loop_t *loop_;
+	WorkerPool *workers_;
+	IoRing *ring_;
+	BlockCache *cache_;
+	TrialCache *trialCache_;
+	const std::vector<Task> &tasks_;
+	const CompressOptions &options_;
+	size_t parallel_;
+	size_t next_ = 0;
+	size_t reading_ = 0;
+	bool starting_ = false;
+
+	// Finished tasks are deleted on the next loop iteration, outside their own callbacks.
+	uv_idle_t *reap_;
+	std::vector<CompressionTask *> finished_;
+	// Failed tasks may still have work in the threadpool, so they wait until the end.
+	std::vector<CompressionTask *> failed_;
+	std::vector<CompressionTask *> active_;
+};
+
+CompressionQueue::CompressionQueue(uv_loop_t *loop, WorkerPool *workers, IoRing *ring, BlockCache *cache, TrialCache *trialCache, const std::vector<Task> &tasks, const CompressOptions &options)
+	: loop_(loop), workers_(workers), ring_(ring), cache_(cache), trialCache_(trialCache), tasks_(tasks), options_(options),
+	parallel_(options.parallel_tasks < 1 ? 1 : options.parallel_tasks) {
+	reap_ = new uv_idle_t;
+	uv_idle_init(loop_, reap_);
+	reap_->data = this;
+}
+
+CompressionQueue::~CompressionQueue() {
+	for (CompressionTask *task : finished_) {
+		delete task;
+	}
+	for (CompressionTask *task : failed_) {
+		delete task;
+	}
+	for (CompressionTask *task : active_) {
+		delete task;
+	}
+	CloseAndDelete(reap_);
+}
+
+void CompressionQueue::Start() {
+	StartNext();
+}
+
+void CompressionQueue::StartNext() {
+	// A task may fail immediately, which would call us again.
+	if (starting_) {
+		return;
+	}
+
+	starting_ = true;
+	while (reading_ < parallel_ && next_ < tasks_.size()) {
+		CompressionTask *task = new CompressionTask(loop_, workers_, ring_, cache_, trialCache_, tasks_[next_++], options_);
+		active_.push_back(task);
+		++reading_;
+
+		task->OnInputDone([this]() {
+			--reading_;
+			StartNext();
+		});
+		task->OnComplete([this, task](bool success) {
+			active_.erase(std::find(active_.begin(), active_.end(), task));
+			if (success) {
+				finished_.push_back(task);
+				uv_idle_start(reap_, [](uv_idle_t *handle) {
+					static_cast<CompressionQueue *>(handle->data)->Reap();
+				});
+			} else {
+				failed_.push_back(task);
+			}
+		});
+		task->Enqueue();
+	}
+	starting_ = false;
+}
+
+void CompressionQueue::Reap() {
+	uv_idle_stop(reap_);
+	for (CompressionTask *task : finished_) {
+		delete task;
+	}
+	finished_.clear();
+}
+
+void Compress(const std::vector<Task> &tasks, const CompressOptions &options) {
 	uv_loop_t loop;
 	uv_loop_init(&loop);
 
-	for (const Task &t : tasks) {
-		CompressionTask task(&loop, t);
-		task.Enqueue();
+	{
+		// Identical blocks (i.e. across discs of the same game) can reuse results.
+		BlockCache cache(options.cache_size);
+		// And trials can be reused from previous runs, even with different options.
+		TrialCache trialCache(&loop);
+		if (!options.cache_dir.empty() && !trialCache.Open(options.cache_dir)) {
+			for (const Task &task : tasks) {
+				task.error(&task, TASK_INVALID_OPTION, "Could not open cache directory");
+			}
+			uv_loop_close(&loop);
+			return;
+		}
+		// Compression gets its own threads, and libuv's threadpool only does file I/O.
+		WorkerPool workers(&loop);
+		workers.Start(options.threads);
+
+		// If io_uring isn't available, file data goes through the threadpool as usual.
+		IoRing ring(&loop);
+		IoRing *useRing = options.use_io_uring && ring.Start(IO_RING_ENTRIES) ? &ring : nullptr;
+
+		CompressionQueue queue(&loop, &workers, useRing, &cache, &trialCache, tasks, options);
+		queue.Start();
 		uv_run(&loop, UV_RUN_DEFAULT);
 	}
 
@@ -50,22 +50,137 @@ enum TaskFlags {
 	TASKFLAG_DECOMPRESS = 0x400,
 	TASKFLAG_MEASURE = 0x2000,
 	TASKFLAG_FMT_DAX = 0x800,
+
+	// Queue each trial of a block as a separate job, so slow blocks use more cores.
+	TASKFLAG_SPLIT_TRIALS = 0x4000,
+	// Run methods that rarely win on only a sample of blocks.
+	TASKFLAG_ADAPTIVE_TRIALS = 0x8000,
+};
+
+// Trials are always submitted in this order, which matters for ties.
+enum TrialMethod {
+	TRIAL_ZLIB_DEFAULT,
+	TRIAL_ZLIB_FILTERED,
+	TRIAL_ZLIB_HUFFMAN,
+	TRIAL_ZLIB_RLE,
+	TRIAL_ZOPFLI,
+	TRIAL_7ZIP,
+	TRIAL_LIBDEFLATE,
+	TRIAL_LZ4HC_4,
+	TRIAL_LZ4HC_7,
+	TRIAL_LZ4HC_10,
+	TRIAL_LZ4HC_13,
+	TRIAL_LZ4HC_16,
+	TRIAL_LZ4,
+
+	TRIAL_METHOD_COUNT,
+};
+
+const char *TrialMethodName(TrialMethod method);
+
+// Entropy is in bits per byte, so anything at 8 or above never skips.
+static const double DEFAULT_ENTROPY_THRESHOLD = 7.9;
+// In megabytes.  Compressed blocks are small, so this remembers a lot of them.
+static const uint32_t DEFAULT_CACHE_SIZE = 64;
+// Input reads kept in flight at once, and bytes in each.  More helps with high latency storage.
+static const uint32_t DEFAULT_READ_AHEAD = 4;
+static const uint32_t DEFAULT_READ_SIZE = 1024 * 1024;
+
+// Compressed size as a fraction of the block, in steps of 10%.  Anything larger goes in the last.
+static const int STATS_RATIO_BUCKETS = 10;
+
+struct MethodStats {
+	int64_t trials;
+	// Trials left out by TASKFLAG_ADAPTIVE_TRIALS.
+	int64_t pruned;
+	// Blocks where this method had the best result.
+	int64_t wins;
+	// For wins, how much smaller than the next best method (or uncompressed) it was.
+	// Losing methods may stop early once they can't win, so this can overestimate.
+	int64_t bytes_saved;
+	// Time spent running this method (on a worker thread, so roughly CPU time.)
+	uint64_t cpu_ns;
+	int64_t ratios[STATS_RATIO_BUCKETS];
+};
+
+struct TaskStats {
+	int64_t blocks;
+	// Blocks that looked incompressible, and so skipped trials.
+	int64_t blocks_skipped;
+	// Blocks of a single repeated byte, which reused an earlier result.
+	int64_t blocks_filled;
+	// Blocks found in the cache, because the same data was compressed before.
+	int64_t blocks_cached;
+	// Trials loaded from the cache directory, instead of run.
+	int64_t trials_known;
+	// Input blocks decompressed (for compressed input.)
+	int64_t input_decompressed;
+	// Only counts blocks that ran (or loaded) trials, not skipped or reused blocks.
+	MethodStats methods[TRIAL_METHOD_COUNT];
+};
+
+// Details of a single block, after compression.
+struct BlockStats {
+	int64_t pos;
+	uint32_t size;
+	bool compressed;
+	bool skipped;
+	bool filled;
+	bool cached;
+	// The TrialMethod that won, or -1 if none ran or it was left uncompressed.
+	int winner;
+	// Compressed size for each method, or 0 if failed (or stopped once it couldn't win), or -1 if not run.
+	int32_t trial_sizes[TRIAL_METHOD_COUNT];
+	uint64_t trial_ns[TRIAL_METHOD_COUNT];
+	// Mask of (1 << TrialMethod) left out by TASKFLAG_ADAPTIVE_TRIALS.
+	uint32_t pruned;
 };
 
 typedef std::function<void (const Task *, TaskStatus status, int64_t pos, int64_t total, int64_t written)> ProgressCallback;
 typedef std::function<void (const Task *, TaskStatus status, const char *reason)> ErrorCallback;
+// Called after success with totals for the task.  Optional.
+typedef std::function<void (const Task *, const TaskStats &stats)> StatsCallback;
+// Called for each block in order of completion (not position.)  Optional.
+typedef std::function<void (const Task *, const BlockStats &stats)> BlockStatsCallback;
 
 struct Task {
 	std::string input;
 	std::string output;
 	ProgressCallback progress;
 	ErrorCallback error;
+	StatsCallback stats;
+	BlockStatsCallback block_stats;
 	uint32_t block_size;
 	uint32_t flags;
 	double orig_max_cost_percent;
 	double lz4_max_cost_percent;
+	// Blocks with more entropy than this (in bits per byte) skip trials, unless they have repeats.
+	double entropy_threshold;
+};
+
+// Options that apply to the whole batch, rather than a single task.
+struct CompressOptions {
+	// How many tasks may read input at the same time.
+	// A task still finishing its last blocks doesn't count.
+	int parallel_tasks;
+	// Threads used for compression, or 0 for one per CPU.
+	// File I/O stays on the libuv threadpool, so it never waits behind compression.
+	int threads;
+	// Memory for remembering results of repeated blocks across all tasks, or 0 to disable.
+	uint64_t cache_size;
+	// Directory to save trial results to, and reuse them from.  Empty to disable.
+	std::string cache_dir;
+	// Input reads kept in flight for each task, and bytes in each.
+	uint32_t read_ahead;
+	uint32_t read_size;
+	// Map input files into memory where possible, instead of reading them.
+	bool use_mapping;
+	// Read and write file data through io_uring where available (Linux only.)
+	bool use_io_uring;
+	// Drop input and output data from the OS cache once used, for large batches.
+	bool drop_cache;
 };
 
-void Compress(const std::vector<Task> &tasks);
+void Compress(const std::vector<Task> &tasks, const CompressOptions &options);
 
 };
@@ -20,6 +20,12 @@ enum CSOFormat {
 	CSO_FMT_DAX,
 };
 
+enum SectorFormat {
+	SECTOR_FMT_ORIG,
+	SECTOR_FMT_DEFLATE,
+	SECTOR_FMT_LZ4,
+};
+
 #ifdef _MSC_VER
 #pragma pack(push, 1)
 #define PACKED
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <cerrno>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "file_cache.h"
+
+namespace maxcso {
+
+void AdviseSequential(uv_file file) {
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void DropCached(uv_file file, int64_t pos, int64_t len) {
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(file, pos, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void FlushAndDropCached(uv_file file, int64_t pos, int64_t len) {
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+	// Dirty pages can't be dropped, so start writing them and wait.
+	sync_file_range(file, pos, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+	DropCached(file, pos, len);
+}
+
+bool FindHole(uv_file file, int64_t pos, int64_t size, int64_t &holeStart, int64_t &holeEnd) {
+#ifdef SEEK_HOLE
+	// Every file has a hole at the end, so this only fails past it.
+	const off_t hole = lseek(file, pos, SEEK_HOLE);
+	if (hole < 0 || hole >= size) {
+		return false;
+	}
+	off_t data = lseek(file, hole, SEEK_DATA);
+	if (data < 0) {
+		// No more data, so the rest is a hole.
+		if (errno != ENXIO) {
+			return false;
+		}
+		data = size;
+	}
+
+	holeStart = hole;
+	holeEnd = std::min(static_cast<int64_t>(data), size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+};
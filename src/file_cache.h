@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include "uv.h"
+
+namespace maxcso {
+
+// Hints for the OS page cache, so huge batches don't push everything else out of memory.
+// These do nothing where unsupported.  A len of 0 means to the end of the file.
+
+// Reads will be sequential, so read ahead more and drop behind sooner.
+void AdviseSequential(uv_file file);
+// Drops clean cached data, i.e. input we've used.  Quick enough for the loop thread.
+void DropCached(uv_file file, int64_t pos, int64_t len);
+// Waits for written data to reach the disk, then drops it.  Blocks, so use the threadpool.
+void FlushAndDropCached(uv_file file, int64_t pos, int64_t len);
+
+// Finds the first hole (unallocated range, which reads as zeros) from pos, before size.
+// Returns false if there's none, or the filesystem can't tell us.
+bool FindHole(uv_file file, int64_t pos, int64_t size, int64_t &holeStart, int64_t &holeEnd);
+
+};
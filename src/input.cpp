@@ -1,22 +1,73 @@
+#include <algorithm>
 #include <cstring>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "input.h"
 #include "buffer_pool.h"
+#include "compress.h"
+#include "codecs.h"
 #include "cso.h"
 #include "dax.h"
+#include "file_cache.h"
+#include "io_ring.h"
+#include "worker_pool.h"
 #include "lz4.h"
+#include "libdeflate.h"
 #define ZLIB_CONST
 #include "zlib.h"
 
 namespace maxcso {
 
 static const uint32_t MAX_BLOCK_SIZE = 0x40000;
+// Matches the default size of the libuv threadpool.
+static const uint32_t DEFAULT_DECOMPRESS_AHEAD = 4;
+// ISO reads go straight into one buffer per block, and libuv and io_uring only take this many at once.
+static const uint32_t MAX_READ_BLOCKS = 1024;
 
 Input::Input(uv_loop_t *loop)
-	: loop_(loop), type_(UNKNOWN), paused_(false), resumeShouldRead_(false), size_(-1), cache_(nullptr),
-	csoIndex_(nullptr), daxSize_(nullptr), daxIsNC_(nullptr) {
+	: loop_(loop), type_(UNKNOWN), paused_(false), resumeShouldRead_(false), failed_(false), size_(-1), blockSize_(SECTOR_SIZE),
+	workers_(nullptr), ring_(nullptr), decompressAhead_(DEFAULT_DECOMPRESS_AHEAD), decompressing_(0), decompressed_(0), readAhead_(DEFAULT_READ_AHEAD), readSize_(DEFAULT_READ_SIZE), firstSlot_(0), nextSlot_(0),
+	inFlight_(0), readPos_(0), readEnd_(0), waiting_(false), sparse_(false), holeStart_(0), holeEnd_(0), dropCache_(false), useMapping_(false), map_(nullptr), mapSize_(0), cache_(nullptr), csoIndex_(nullptr), daxSize_(nullptr), daxIsNC_(nullptr) {
 }
 
 Input::~Input() {
+	for (const ReadyBlock &block : ready_) {
+		if (!block.mapped) {
+			pool.Release(block.buffer);
+		}
+	}
+	ready_.clear();
+	for (const PendingBlock &block : pending_) {
+		pool.Release(block.buffer);
+	}
+	pending_.clear();
+	for (DecompressJob &job : jobs_) {
+		if (job.srcCopy != nullptr) {
+			pool.Release(job.srcCopy);
+			job.srcCopy = nullptr;
+		}
+		if (job.own != nullptr) {
+			pool.Release(job.own);
+			job.own = nullptr;
+		}
+	}
+	for (ReadSlot &slot : slots_) {
+		for (uint8_t *block : slot.blocks) {
+			pool.Release(block);
+		}
+		slot.blocks.clear();
+		delete [] slot.data;
+		slot.data = nullptr;
+	}
+#ifndef _WIN32
+	if (map_ != nullptr) {
+		munmap(map_, mapSize_);
+		map_ = nullptr;
+	}
+#endif
 	delete [] cache_;
 	cache_ = nullptr;
 	delete [] csoIndex_;
@@ -35,10 +86,45 @@ void Input::OnBegin(InputBeginCallback begin) {
 	begin_ = begin;
 }
 
+void Input::SetBlockSize(uint32_t blockSize) {
+	blockSize_ = blockSize;
+}
+
+void Input::SetReadAhead(uint32_t count, uint32_t size) {
+	readAhead_ = std::max(count, static_cast<uint32_t>(1));
+	readSize_ = std::max(size, SECTOR_SIZE);
+}
+
+void Input::UseMapping(bool enable) {
+	useMapping_ = enable;
+}
+
+void Input::SetWorkers(WorkerPool *workers, uint32_t count) {
+	workers_ = workers;
+	decompressAhead_ = std::max(count, static_cast<uint32_t>(1));
+}
+
+void Input::SetRing(IoRing *ring) {
+	ring_ = ring;
+}
+
+void Input::DropCache(bool enable) {
+	dropCache_ = enable;
+}
+
 void Input::Pipe(uv_file file, InputCallback callback) {
 	file_ = file;
 	callback_ = callback;
 	pos_ = 0;
+	// These never move, since each has a request in flight.  An input block may span two reads.
+	slots_.resize(std::max(readAhead_, static_cast<uint32_t>(2)));
+	jobs_.resize(decompressAhead_);
+	if (dropCache_) {
+		// Mapped data stays cached while we use it, and we can't tell when blocks are done.
+		AdviseSequential(file_);
+	} else if (useMapping_) {
+		MapFile();
+	}
 
 	// First, we need to check what format it is in.
 	DetectFormat();
@@ -86,12 +172,8 @@ void Input::DetectFormat() {
 				pool.Release(headerBuf);
 				freeHeaderBuf = false;
 				// Over-allocate a bit in case of inefficient padding between blocks.
-				if (csoBlockSize_ * 2 > pool.bufferSize) {
-					if (!pool.SetBufferSize(csoBlockSize_ * 2)) {
-						finish_(false, "Unable to update buffer size to match decompress block size");
-						size_ = -1;
-						return;
-					}
+				if (csoBlockSize_ * 2 > pool.BufferSize()) {
+					pool.SetBufferSize(csoBlockSize_ * 2);
 				}
 
 				const uint32_t sectors = static_cast<uint32_t>(SizeAligned() >> csoBlockShift_);
@@ -100,7 +182,7 @@ void Input::DetectFormat() {
 				const uv_buf_t buf = uv_buf_init(reinterpret_cast<char *>(csoIndex_), bytes);
 				SetupCache(csoBlockSize_);
 
-				uv_.fs_read(loop_, &req_, file_, &buf, 1, sizeof(CSOHeader), [this, bytes](uv_fs_t *req) {
+				uv_.fs_read(loop_, &req_, file_, &buf, 1, sizeof(CSOHeader), [this, bytes, sectors](uv_fs_t *req) {
 					if (req->result != bytes) {
 						// Index wasn't all there, this file is corrupt.
 						finish_(false, "Unable to read entire index");
@@ -109,8 +191,11 @@ void Input::DetectFormat() {
 					}
 					uv_fs_req_cleanup(req);
 
+					// No need to read past the last block.
+					readEnd_ = static_cast<uint64_t>(csoIndex_[sectors] & 0x7FFFFFFF) << csoIndexShift_;
+
 					begin_(size_);
-					ReadSector();
+					ReadBlock();
 				});
 			}
 		} else if (!memcmp(headerBuf, DAX_MAGIC, 4)) {
@@ -161,8 +246,13 @@ void Input::DetectFormat() {
 					}
 					delete [] areas;
 
+					const uint32_t frames = static_cast<uint32_t>((size_ + DAX_FRAME_SIZE - 1) >> DAX_FRAME_SHIFT);
+					for (uint32_t frame = 0; frame < frames; ++frame) {
+						readEnd_ = std::max(readEnd_, static_cast<int64_t>(daxIndex_[frame]) + daxSize_[frame]);
+					}
+
 					begin_(size_);
-					ReadSector();
+					ReadBlock();
 				});
 			}
 		} else {
@@ -175,11 +265,13 @@ void Input::DetectFormat() {
 					uv_fs_req_cleanup(req);
 				} else {
 					size_ = req->statbuf.st_size;
+					readEnd_ = size_;
+					// Only look for holes if fewer blocks are allocated than the size needs.
+					sparse_ = static_cast<int64_t>(req->statbuf.st_blocks) * 512 < size_;
 					uv_fs_req_cleanup(req);
 
-					SetupCache(SECTOR_SIZE);
 					begin_(size_);
-					ReadSector();
+					ReadBlock();
 				}
 			});
 		}
@@ -190,40 +282,99 @@ void Input::DetectFormat() {
 	});
 }
 
+void Input::MapFile() {
+#ifndef _WIN32
+	// Pipes and such can't be mapped, so they just use reads.
+	struct stat st;
+	if (fstat(file_, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return;
+	}
+	if (static_cast<uint64_t>(st.st_size) > SIZE_MAX) {
+		return;
+	}
+
+	void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, file_, 0);
+	if (p == MAP_FAILED) {
+		return;
+	}
+	madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+	map_ = static_cast<uint8_t *>(p);
+	mapSize_ = st.st_size;
+#endif
+}
+
 void Input::SetupCache(uint32_t minSize) {
 	const uint32_t STANDARD_SIZE = 32768;
 	while (minSize < STANDARD_SIZE) {
 		minSize <<= 1;
 	}
 
-	cachePos_ = size_;
 	cacheSize_ = minSize;
 	cache_ = new uint8_t[cacheSize_];
 }
 
-void Input::ReadSector() {
-	// At the end of the file, all done.
-	if (pos_ >= size_) {
-		finish_(true, nullptr);
-		return;
+void Input::ReadBlock() {
+	for (;;) {
+		if (failed_) {
+			return;
+		}
+
+		// At the end of the file, all done.
+		if (ready_.empty() && pending_.empty() && pos_ >= size_) {
+			if (inFlight_ != 0) {
+				// Wait for any reads past what we needed, so nothing's left running.
+				waiting_ = true;
+				return;
+			}
+			if (dropCache_) {
+				// Also the header and index, which were read outside the slots.
+				DropCached(file_, 0, 0);
+			}
+			finish_(true, nullptr);
+			return;
+		}
+
+		if (paused_) {
+			// When we resume, it'll need to call ReadBlock() to resume.
+			resumeShouldRead_ = true;
+			return;
+		}
+
+		if (!ready_.empty()) {
+			// This ends up being owned by the compressor.
+			const ReadyBlock block = ready_.front();
+			ready_.pop_front();
+			callback_(block.pos, block.buffer, block.mapped);
+		} else if (!pending_.empty() && pending_.front().waiting == 0 && (pending_.size() > 1 || pos_ >= std::min(pending_.front().pos + blockSize_, size_))) {
+			const PendingBlock block = pending_.front();
+			pending_.pop_front();
+			// The last block may be short, so pad it out.
+			const int64_t end = block.pos + blockSize_;
+			if (end > size_) {
+				memset(block.buffer + (size_ - block.pos), 0, static_cast<size_t>(end - size_));
+			}
+			ready_.push_back(ReadyBlock{ block.pos, block.buffer, false });
+		} else if (pos_ >= size_) {
+			// Everything's queued, just waiting on decompression now.
+			waiting_ = true;
+			return;
+		} else if (!FillBlock()) {
+			return;
+		}
 	}
+}
 
-	if (paused_) {
-		// When we resume, it'll need to call ReadSector() to resume.
-		resumeShouldRead_ = true;
-		return;
+bool Input::FillBlock() {
+	if (type_ == ISO) {
+		return map_ != nullptr ? TakeMappedBlock() : TakeISOBlocks();
 	}
 
 	// Position of data in file.
 	int64_t pos = pos_;
-	// Offset into position where our data is.
-	uint32_t offset = 0;
 	unsigned int len = SECTOR_SIZE;
 	bool compressedDeflate = false;
 	bool compressedLZ4 = false;
 	switch (type_) {
-	case ISO:
-		break;
 	case CSO1:
 	case CSO2:
 	case ZSO:
@@ -235,7 +386,6 @@ void Input::ReadSector() {
 			pos = static_cast<uint64_t>(index & 0x7FFFFFFF) << csoIndexShift_;
 			const int64_t nextPos = static_cast<uint64_t>(nextIndex & 0x7FFFFFFF) << csoIndexShift_;
 			len = static_cast<unsigned int>(nextPos - pos);
-			offset = pos_ & static_cast<uint64_t>(csoBlockSize_ - 1);
 
 			switch (type_) {
 			case CSO1:
@@ -255,14 +405,8 @@ void Input::ReadSector() {
 			case ISO:
 			case DAX:
 			case UNKNOWN:
-				finish_(false, "Unexpected input file type");
-				break;
-			}
-
-			if (!compressedDeflate && !compressedLZ4 && offset != 0) {
-				pos += offset;
-				len -= offset;
-				offset = 0;
+				Fail("Unexpected input file type");
+				return false;
 			}
 		}
 		break;
@@ -272,122 +416,416 @@ void Input::ReadSector() {
 			pos = daxIndex_[frame];
 			len = daxSize_[frame];
 			compressedDeflate = !daxIsNC_[frame];
-			offset = pos_ & DAX_FRAME_MASK;
-
-			if (!compressedDeflate && offset != 0) {
-				pos += offset;
-				len -= offset;
-				offset = 0;
-			}
 		}
 		break;
+	case ISO:
 	case UNKNOWN:
-		finish_(false, "Unexpected input file type");
-		break;
+		Fail("Unexpected input file type");
+		return false;
 	}
 
-	// This ends up being owned by the compressor.
-	if (pos >= cachePos_ && pos + len <= cachePos_ + cacheSize_) {
-		// Already read in, let's just reuse.
-		if (compressedDeflate || compressedLZ4) {
-			EnqueueDecompressSector(cache_ + pos - cachePos_, len, offset, compressedLZ4);
-		} else {
-			uint8_t *readBuf = pool.Alloc();
-			memcpy(readBuf, cache_ + pos - cachePos_, len);
-			callback_(pos_, readBuf);
+	// We always take a whole input block at a time, which may be short at the end.
+	const uint32_t size = static_cast<uint32_t>(std::min(static_cast<int64_t>(csoBlockSize_), size_ - pos_));
+	const int64_t lastBlockPos = (pos_ + size - 1) & ~static_cast<int64_t>(blockSize_ - 1);
+	const bool needsBlock = pending_.empty() || pending_.back().pos < lastBlockPos;
+	const bool compressed = compressedDeflate || compressedLZ4;
+	// Don't get too far ahead of the blocks handed out.  Either way, a decompression will wake us.
+	if ((needsBlock && pending_.size() >= MaxPending()) || (compressed && decompressing_ >= jobs_.size())) {
+		waiting_ = true;
+		return false;
+	}
+	if (compressed && len > pool.BufferSize()) {
+		Fail("Input block too large");
+		return false;
+	}
 
-			pos_ += SECTOR_SIZE;
-			ReadSector();
-		}
-	} else {
-		const uv_buf_t buf = uv_buf_init(reinterpret_cast<char *>(cache_), cacheSize_);
-		cachePos_ = pos;
-		uv_.fs_read(loop_, &req_, file_, &buf, 1, pos, [this, len, offset, compressedDeflate, compressedLZ4](uv_fs_t *req) {
-			if (req->result < static_cast<ssize_t>(len)) {
-				finish_(false, "Unable to read entire sector");
-				uv_fs_req_cleanup(req);
-				return;
-			}
-			uv_fs_req_cleanup(req);
+	if (!compressed) {
+		// Stored as is, so we only need what we'll use.
+		len = size;
+	}
+	const uint8_t *const src = Fetch(pos, len);
+	if (src == nullptr) {
+		return false;
+	}
 
-			if (compressedDeflate || compressedLZ4) {
-				EnqueueDecompressSector(cache_, len, offset, compressedLZ4);
-			} else {
-				uint8_t *readBuf = pool.Alloc();
-				memcpy(readBuf, cache_, len);
-				callback_(pos_, readBuf);
+	while (pending_.empty() || pending_.back().pos < lastBlockPos) {
+		const int64_t blockPos = pending_.empty() ? (pos_ & ~static_cast<int64_t>(blockSize_ - 1)) : pending_.back().pos + blockSize_;
+		pending_.push_back(PendingBlock{ blockPos, pool.Alloc(), 0 });
+	}
 
-				pos_ += SECTOR_SIZE;
-				ReadSector();
-			}
-		});
+	if (compressed) {
+		QueueDecompress(src, pos, len, compressedLZ4, size);
+	} else {
+		CopyToPending(pos_, src, size);
+	}
+	pos_ += size;
+	return true;
+}
+
+void Input::CopyToPending(int64_t pos, const uint8_t *src, uint32_t size) {
+	while (size != 0) {
+		PendingBlock &block = PendingAt(pos);
+		const uint32_t offset = static_cast<uint32_t>(pos - block.pos);
+		const uint32_t len = std::min(size, blockSize_ - offset);
+		memcpy(block.buffer + offset, src, len);
+		pos += len;
+		src += len;
+		size -= len;
 	}
 }
 
-void Input::EnqueueDecompressSector(uint8_t *src, uint32_t len, uint32_t offset, bool isLZ4) {
-	// We swap this with the compressed buf, and free the readBuf.
-	uint8_t *const actualBuf = pool.Alloc();
-	decompressError_.clear();
-	decompressResultSize_ = 0;
-	uv_.queue_work(loop_, &work_, [this, actualBuf, src, len, isLZ4](uv_work_t *req) {
+void Input::QueueDecompress(const uint8_t *src, int64_t srcPos, uint32_t len, bool isLZ4, uint32_t size) {
+	DecompressJob *job = nullptr;
+	for (DecompressJob &j : jobs_) {
+		if (!j.busy) {
+			job = &j;
+			break;
+		}
+	}
+
+	job->busy = true;
+	++decompressing_;
+	++decompressed_;
+	job->pos = pos_;
+	job->size = size;
+	job->len = len;
+	job->isLZ4 = isLZ4;
+	job->resultSize = 0;
+	job->error.clear();
+	if (src == cache_) {
+		// Joined from two reads, and cache_ is about to be reused.
+		job->srcCopy = pool.Alloc();
+		memcpy(job->srcCopy, src, len);
+		job->src = job->srcCopy;
+		job->srcPos = -1;
+	} else {
+		job->src = src;
+		// Keep the read around until we're done, unless it's mapped.
+		job->srcPos = map_ == nullptr ? srcPos : -1;
+	}
+
+	if (csoBlockSize_ <= blockSize_) {
+		// Decompress right where it goes.  Others may be writing to the same block, but not the same bytes.
+		PendingBlock &block = PendingAt(pos_);
+		job->dst = block.buffer + (pos_ - block.pos);
+		++block.waiting;
+	} else {
+		// Larger than our blocks, so it's split up afterward.
+		job->own = pool.Alloc();
+		job->dst = job->own;
+		for (int64_t p = pos_; p < pos_ + size; p += blockSize_) {
+			++PendingAt(p).waiting;
+		}
+	}
+
+	auto work = [this, job](uv_work_t *req) {
 		bool result;
-		if (isLZ4) {
-			result = DecompressSectorLZ4(actualBuf, src, len, csoBlockSize_, decompressResultSize_, decompressError_);
+		if (job->isLZ4) {
+			result = DecompressSectorLZ4(job->dst, job->src, job->len, csoBlockSize_, job->resultSize, job->error);
 		} else {
-			result = DecompressSectorDeflate(actualBuf, src, len, type_, decompressResultSize_, decompressError_);
+			result = DecompressSectorDeflate(job->dst, job->src, job->len, csoBlockSize_, type_, job->resultSize, job->error);
 		}
 		if (!result) {
-			if (decompressError_.empty()) {
-				decompressError_ = "Unknown error";
+			if (job->error.empty()) {
+				job->error = "Unknown error";
 			}
 		}
-	}, [this, actualBuf, offset](uv_work_t *req, int status) {
-		if (!decompressError_.empty()) {
-			finish_(false, decompressError_.c_str());
-			pool.Release(actualBuf);
-			return;
-		} else if (status == -1) {
-			finish_(false, "Decompression work failed");
-			pool.Release(actualBuf);
-			return;
+	};
+	auto after = [this, job](uv_work_t *req, int status) {
+		--decompressing_;
+		job->busy = false;
+		if (job->srcCopy != nullptr) {
+			pool.Release(job->srcCopy);
+			job->srcCopy = nullptr;
+		}
+
+		const char *error = nullptr;
+		if (!job->error.empty()) {
+			error = job->error.c_str();
+		} else if (status < 0) {
+			error = "Decompression work failed";
+		} else if (job->resultSize > csoBlockSize_) {
+			error = "Decompression produced more data than expected";
+		} else if (job->resultSize < job->size) {
+			// Anything past size_ is just padding, so we ignore it.
+			error = "Decompression produced less data than expected";
+		}
+
+		if (error == nullptr && !failed_) {
+			if (job->own != nullptr) {
+				CopyToPending(job->pos, job->own, job->size);
+			}
+			const int64_t end = job->pos + job->size;
+			for (int64_t p = job->pos; p < end; p += std::min(blockSize_, csoBlockSize_)) {
+				--PendingAt(p).waiting;
+			}
+		}
+		if (job->own != nullptr) {
+			pool.Release(job->own);
+			job->own = nullptr;
 		}
-		if (decompressResultSize_ > csoBlockSize_) {
-			finish_(false, "Decompression produced more data than expected");
-			pool.Release(actualBuf);
+
+		if (failed_) {
 			return;
 		}
+		if (error != nullptr) {
+			Fail(error);
+		} else if (waiting_) {
+			waiting_ = false;
+			ReadBlock();
+		}
+	};
+
+	int result;
+	if (workers_ != nullptr) {
+		result = workers_->queue_work(&job->work, work, after);
+	} else {
+		result = uv_.queue_work(loop_, &job->work, work, after);
+	}
+	if (result != 0) {
+		Fail("Decompression work failed");
+	}
+}
 
-		int64_t sectorPos = pos_ - offset;
-		uint32_t resultSize = decompressResultSize_;
-		if (sectorPos + resultSize > size_) {
-			// Ignore the padding at the end of the last block.
-			resultSize = static_cast<uint32_t>(size_ - sectorPos);
+int64_t Input::PinnedPos() {
+	int64_t pinned = INT64_MAX;
+	for (const DecompressJob &job : jobs_) {
+		if (job.busy && job.srcPos >= 0) {
+			pinned = std::min(pinned, job.srcPos);
 		}
+	}
+	return pinned;
+}
 
-		// If the input has a larger block size than SECTOR_SIZE, queue each up here.
-		// Prevents double decompression of input blocks.
-		for (uint32_t suboffset = offset; suboffset < resultSize; suboffset += SECTOR_SIZE) {
-			const bool lastSubBlock = suboffset + SECTOR_SIZE >= resultSize;
-			uint8_t *const subBuf = lastSubBlock ? actualBuf : pool.Alloc();
-			if (lastSubBlock) {
-				memmove(actualBuf, actualBuf + suboffset, SECTOR_SIZE);
-			} else {
-				memmove(subBuf, actualBuf + suboffset, SECTOR_SIZE);
+bool Input::TakeISOBlocks() {
+	IssueReads();
+	if (firstSlot_ == nextSlot_) {
+		Fail("Unable to read entire sector");
+		return false;
+	}
+
+	ReadSlot &slot = Slot(firstSlot_);
+	if (slot.inFlight) {
+		waiting_ = true;
+		return false;
+	}
+	if (slot.result != static_cast<ssize_t>(slot.size)) {
+		Fail("Unable to read entire sector");
+		return false;
+	}
+
+	if (slot.hole) {
+		// Every block is zeros (including any padding), so they all share one.
+		const int64_t end = slot.pos + slot.size;
+		while (pos_ < end) {
+			ready_.push_back(ReadyBlock{ pos_, zeroBlock_.data(), true });
+			pos_ = std::min(pos_ + blockSize_, end);
+		}
+		++firstSlot_;
+		IssueReads();
+		return true;
+	}
+
+	for (uint8_t *block : slot.blocks) {
+		const uint32_t len = static_cast<uint32_t>(std::min(static_cast<int64_t>(blockSize_), size_ - pos_));
+		// The last block may be short, so pad it out.
+		memset(block + len, 0, blockSize_ - len);
+		ready_.push_back(ReadyBlock{ pos_, block, false });
+		pos_ += len;
+	}
+	slot.blocks.clear();
+
+	if (dropCache_) {
+		DropCached(file_, slot.pos, slot.size);
+	}
+	++firstSlot_;
+	IssueReads();
+	return true;
+}
+
+bool Input::TakeMappedBlock() {
+	const uint32_t len = static_cast<uint32_t>(std::min(static_cast<int64_t>(blockSize_), size_ - pos_));
+	if (pos_ + len > mapSize_) {
+		Fail("Unable to read entire sector");
+		return false;
+	}
+
+	if (len == blockSize_) {
+		ready_.push_back(ReadyBlock{ pos_, map_ + pos_, true });
+	} else {
+		// The last block may be short, so it needs padding.
+		uint8_t *block = pool.Alloc();
+		memcpy(block, map_ + pos_, len);
+		memset(block + len, 0, blockSize_ - len);
+		ready_.push_back(ReadyBlock{ pos_, block, false });
+	}
+	pos_ += len;
+	return true;
+}
+
+const uint8_t *Input::Fetch(int64_t pos, uint32_t len) {
+	if (map_ != nullptr) {
+		if (pos + len > mapSize_) {
+			Fail("Unable to read entire sector");
+			return nullptr;
+		}
+		return map_ + pos;
+	}
+
+	// Anything before pos is used up, which makes room to read further ahead.
+	// Unless a decompression is still using it.
+	const int64_t keepPos = std::min(pos, PinnedPos());
+	while (firstSlot_ < nextSlot_) {
+		const ReadSlot &slot = Slot(firstSlot_);
+		if (slot.inFlight || slot.pos + slot.size > keepPos) {
+			break;
+		}
+		if (dropCache_) {
+			DropCached(file_, slot.pos, slot.size);
+		}
+		++firstSlot_;
+	}
+
+	if (firstSlot_ == nextSlot_ || pos < Slot(firstSlot_).pos) {
+		// Not where we were reading, so start over from here once the reads (and their users) finish.
+		if (inFlight_ != 0 || decompressing_ != 0) {
+			waiting_ = true;
+			return nullptr;
+		}
+		firstSlot_ = nextSlot_;
+		readPos_ = pos;
+	}
+	IssueReads();
+
+	uint32_t copied = 0;
+	for (uint64_t n = firstSlot_; n < nextSlot_ && copied < len; ++n) {
+		const ReadSlot &slot = Slot(n);
+		const int64_t start = pos + copied;
+		if (slot.pos + slot.size <= start) {
+			continue;
+		}
+		if (slot.inFlight) {
+			waiting_ = true;
+			return nullptr;
+		}
+
+		const uint32_t offset = static_cast<uint32_t>(start - slot.pos);
+		if (slot.result <= static_cast<ssize_t>(offset)) {
+			break;
+		}
+		const uint32_t avail = std::min(static_cast<uint32_t>(slot.result) - offset, len - copied);
+		if (copied == 0 && avail == len) {
+			// All in one read, no need to copy.
+			return slot.data + offset;
+		}
+		if (len > cacheSize_) {
+			Fail("Input block too large");
+			return nullptr;
+		}
+		memcpy(cache_ + copied, slot.data + offset, avail);
+		copied += avail;
+	}
+
+	if (copied < len) {
+		// Could be that decompressions are holding all the reads.
+		if (inFlight_ != 0 || decompressing_ != 0) {
+			waiting_ = true;
+		} else {
+			Fail("Unable to read entire sector");
+		}
+		return nullptr;
+	}
+	return cache_;
+}
+
+void Input::IssueReads() {
+	while (nextSlot_ - firstSlot_ < slots_.size() && readPos_ < readEnd_) {
+		const uint64_t n = nextSlot_++;
+		ReadSlot &slot = Slot(n);
+		slot.pos = readPos_;
+		slot.result = 0;
+		slot.inFlight = true;
+		slot.hole = false;
+
+		std::vector<uv_buf_t> bufs;
+		if (type_ == ISO) {
+			// Whole blocks only, so they can be handed off as is.
+			const uint32_t readSize = std::min(std::max(readSize_, blockSize_) & ~(blockSize_ - 1), MAX_READ_BLOCKS * blockSize_);
+			slot.size = static_cast<uint32_t>(std::min(static_cast<int64_t>(readSize), readEnd_ - readPos_));
+			slot.size = ClipToHoles(readPos_, slot.size, slot.hole);
+			if (slot.hole) {
+				if (zeroBlock_.empty()) {
+					zeroBlock_.resize(blockSize_, 0);
+				}
+				slot.result = slot.size;
+				slot.inFlight = false;
+				readPos_ += slot.size;
+				continue;
 			}
+			for (uint32_t offset = 0; offset < slot.size; offset += blockSize_) {
+				uint8_t *block = pool.Alloc();
+				slot.blocks.push_back(block);
+				bufs.push_back(uv_buf_init(reinterpret_cast<char *>(block), std::min(blockSize_, slot.size - offset)));
+			}
+		} else {
+			// Must fit at least one input block.
+			const uint32_t readSize = std::max(readSize_, cacheSize_);
+			if (slot.data == nullptr) {
+				slot.data = new uint8_t[readSize];
+			}
+			slot.size = static_cast<uint32_t>(std::min(static_cast<int64_t>(readSize), readEnd_ - readPos_));
+			bufs.push_back(uv_buf_init(reinterpret_cast<char *>(slot.data), slot.size));
+		}
+		readPos_ += slot.size;
+
+		++inFlight_;
+		fs_func_cb done = [this, n](uv_fs_t *req) {
+			ReadSlot &slot = Slot(n);
+			slot.result = req->result;
+			slot.inFlight = false;
+			--inFlight_;
+			uv_fs_req_cleanup(req);
 
-			callback_(pos_, subBuf);
-			pos_ += SECTOR_SIZE;
+			if (waiting_) {
+				waiting_ = false;
+				ReadBlock();
+			}
+		};
+		const unsigned int nbufs = static_cast<unsigned int>(bufs.size());
+		if (ring_ == nullptr || ring_->fs_read(&slot.req, file_, bufs.data(), nbufs, slot.pos, std::move(done)) != 0) {
+			uv_.fs_read(loop_, &slot.req, file_, bufs.data(), nbufs, slot.pos, std::move(done));
+		}
+	}
+}
 
-			// We may have filled early.  In this case, we have to bail and re-decompress part of this block.
-			// Luckily, this isn't common.
-			if (paused_ && !lastSubBlock) {
-				pool.Release(actualBuf);
-				break;
+uint32_t Input::ClipToHoles(int64_t pos, uint32_t len, bool &hole) {
+	hole = false;
+	while (sparse_) {
+		// Only whole blocks in the hole can skip reading, except at the end of the file.
+		const int64_t blockMask = static_cast<int64_t>(blockSize_) - 1;
+		const int64_t start = (holeStart_ + blockMask) & ~blockMask;
+		const int64_t end = holeEnd_ >= size_ ? size_ : holeEnd_ & ~blockMask;
+		if (pos < end && start < end) {
+			if (pos >= start) {
+				hole = true;
+				return static_cast<uint32_t>(std::min(static_cast<int64_t>(len), end - pos));
 			}
+			// Read up to the hole.
+			return static_cast<uint32_t>(std::min(static_cast<int64_t>(len), start - pos));
 		}
 
-		ReadSector();
-	});
+		// Passed this one (or it's too small to use), so find the next.
+		if (!FindHole(file_, std::max(pos, holeEnd_), size_, holeStart_, holeEnd_)) {
+			sparse_ = false;
+		}
+	}
+	return len;
+}
+
+void Input::Fail(const char *reason) {
+	// Other reads may still finish, but nothing should happen after this.
+	failed_ = true;
+	finish_(false, reason);
 }
 
 void Input::Pause() {
@@ -398,41 +836,68 @@ void Input::Resume() {
 	paused_ = false;
 	if (resumeShouldRead_) {
 		resumeShouldRead_ = false;
-		ReadSector();
+		ReadBlock();
 	}
 }
 
-bool Input::DecompressSectorDeflate(uint8_t *dst, const uint8_t *src, unsigned int len, FileType type, uint32_t &readSize, std::string &err) {
-	z_stream z;
-	memset(&z, 0, sizeof(z));
-	// TODO: inflateReset2?
-	if (inflateInit2(&z, type == DAX ? 15 : -15) != Z_OK) {
-		err = z.msg ? z.msg : "Unable to initialize inflate";
-		return false;
+bool Input::DecompressSectorDeflate(uint8_t *dst, const uint8_t *src, unsigned int len, uint32_t dstSize, FileType type, uint32_t &readSize, std::string &err) {
+	// On a worker, reuse its decompressors.  libdeflate is much faster for whole blocks.
+	Codecs *codecs = WorkerPool::ThreadCodecs();
+	libdeflate_decompressor *decompressor = codecs != nullptr ? codecs->LibDeflateDecompressor() : nullptr;
+	if (decompressor != nullptr) {
+		size_t actualSize = 0;
+		libdeflate_result result;
+		if (type == DAX) {
+			result = libdeflate_zlib_decompress(decompressor, src, len, dst, dstSize, &actualSize);
+		} else {
+			result = libdeflate_deflate_decompress(decompressor, src, len, dst, dstSize, &actualSize);
+		}
+		if (result == LIBDEFLATE_SUCCESS) {
+			if (actualSize < SECTOR_SIZE) {
+				err = "Expected to decompress into at least a full sector";
+				return false;
+			}
+			readSize = static_cast<uint32_t>(actualSize);
+			return true;
+		}
+		// Let zlib have a go, for a better error (or in case it's more lenient.)
+	}
+
+	z_stream local;
+	z_stream *z = codecs != nullptr ? codecs->Inflate(type == DAX) : nullptr;
+	if (z == nullptr) {
+		z = &local;
+		memset(z, 0, sizeof(local));
+		if (inflateInit2(z, type == DAX ? 15 : -15) != Z_OK) {
+			err = z->msg ? z->msg : "Unable to initialize inflate";
+			return false;
+		}
 	}
 
-	z.avail_in = len;
-	z.next_out = dst;
-	z.avail_out = pool.bufferSize;
+	z->avail_in = len;
+	z->next_out = dst;
+	z->avail_out = dstSize;
 	// ZLIB_CONST doesn't seem to work on all platforms.
-	z.next_in = const_cast<uint8_t *>(src);
+	z->next_in = const_cast<uint8_t *>(src);
 
-	const int status = inflate(&z, Z_FINISH);
+	const int status = inflate(z, Z_FINISH);
+	const uint32_t totalOut = static_cast<uint32_t>(z->total_out);
+	bool success = true;
 	if (status != Z_STREAM_END) {
-		err = z.msg ? z.msg : "Inflate failed";
-		inflateEnd(&z);
-		return false;
-	}
-
-	if (z.total_out < SECTOR_SIZE) {
+		err = z->msg ? z->msg : "Inflate failed";
+		success = false;
+	} else if (totalOut < SECTOR_SIZE) {
 		err = "Expected to decompress into at least a full sector";
-		inflateEnd(&z);
-		return false;
+		success = false;
 	}
 
-	inflateEnd(&z);
-	readSize = static_cast<uint32_t>(z.total_out);
-	return true;
+	if (z == &local) {
+		inflateEnd(z);
+	}
+	if (success) {
+		readSize = totalOut;
+	}
+	return success;
 }
 
 bool Input::DecompressSectorLZ4(uint8_t *dst, const uint8_t *src, unsigned int len, int dstSize, uint32_t &readSize, std::string &err) {
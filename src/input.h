@@ -1,11 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <string>
+#include <vector>
 #include "uv_helper.h"
 
 namespace maxcso {
 
-typedef std::function<void (int64_t pos, uint8_t *sector)> InputCallback;
+class IoRing;
+class WorkerPool;
+
+// If mapped, block points into the input file and must not be released or changed.
+// It stays valid until the Input is destroyed.
+typedef std::function<void (int64_t pos, uint8_t *block, bool mapped)> InputCallback;
 typedef std::function<void (int64_t size)> InputBeginCallback;
 typedef std::function<void (bool success, const char *reason)> InputFinishCallback;
 
@@ -15,15 +23,47 @@ class Input {
 	~Input();
 	void OnFinish(InputFinishCallback finish);
 	void OnBegin(InputBeginCallback begin);
+	// How much data each callback gets (default SECTOR_SIZE), the last block is padded with zeros.
+	// Call before Pipe(), or from OnBegin.
+	void SetBlockSize(uint32_t blockSize);
+	// Keep up to count reads of size bytes each in flight, ahead of what's been consumed.
+	// Call before Pipe().
+	void SetReadAhead(uint32_t count, uint32_t size);
+	// Map regular files into memory and use them in place, rather than reading.  Call before Pipe().
+	void UseMapping(bool enable);
+	// Decompress up to count input blocks at once, on workers (or the libuv threadpool if nullptr.)
+	// Call before Pipe().
+	void SetWorkers(WorkerPool *workers, uint32_t count);
+	// Read through ring instead of the libuv threadpool, if not nullptr.  Call before Pipe().
+	void SetRing(IoRing *ring);
+	// Drop input from the OS cache once it's used.  This disables mapping.  Call before Pipe().
+	void DropCache(bool enable);
 	void Pipe(uv_file file, InputCallback callback);
 	void Pause();
 	void Resume();
 
+	// Input blocks decompressed.  Pausing keeps what's already decompressed, so each is only done once.
+	int64_t Decompressed() {
+		return decompressed_;
+	}
+
 private:
 	void DetectFormat();
+	void MapFile();
+	bool TakeMappedBlock();
 	void SetupCache(uint32_t minSize);
-	void ReadSector();
-	void EnqueueDecompressSector(uint8_t *src, uint32_t len, uint32_t offset, bool isLZ4);
+	void ReadBlock();
+	// Returns false if waiting on async work, which calls ReadBlock() again.
+	bool FillBlock();
+	bool TakeISOBlocks();
+	// Returns nullptr if waiting on a read (or failed.)  Valid until the next call.
+	const uint8_t *Fetch(int64_t pos, uint32_t len);
+	void IssueReads();
+	uint32_t ClipToHoles(int64_t pos, uint32_t len, bool &hole);
+	void Fail(const char *reason);
+	void CopyToPending(int64_t pos, const uint8_t *src, uint32_t size);
+	void QueueDecompress(const uint8_t *src, int64_t srcPos, uint32_t len, bool isLZ4, uint32_t size);
+	int64_t PinnedPos();
 	inline int64_t SizeAligned();
 
 	enum FileType {
@@ -35,7 +75,7 @@ class Input {
 		DAX,
 	};
 
-	static bool DecompressSectorDeflate(uint8_t *dst, const uint8_t *src, unsigned int len, FileType type, uint32_t &readSize, std::string &err);
+	static bool DecompressSectorDeflate(uint8_t *dst, const uint8_t *src, unsigned int len, uint32_t dstSize, FileType type, uint32_t &readSize, std::string &err);
 	static bool DecompressSectorLZ4(uint8_t *dst, const uint8_t *src, unsigned int len, int dstSize, uint32_t &readSize, std::string &err);
 
 	UVHelper uv_;
@@ -46,19 +86,111 @@ class Input {
 	InputCallback callback_;
 	uv_file file_;
 	uv_fs_t req_;
-	uv_work_t work_;
 	FileType type_;
 
 	bool paused_;
 	bool resumeShouldRead_;
+	bool failed_;
 	int64_t pos_;
 	int64_t size_;
+	uint32_t blockSize_;
+
+	struct ReadyBlock {
+		int64_t pos;
+		uint8_t *buffer;
+		bool mapped;
+	};
+	// Blocks waiting for the callback, while paused.
+	std::deque<ReadyBlock> ready_;
+
+	struct PendingBlock {
+		int64_t pos;
+		uint8_t *buffer;
+		// Decompressions still writing to this block.
+		uint32_t waiting;
+	};
+	// Blocks of compressed input being put together, in order.
+	std::deque<PendingBlock> pending_;
+	PendingBlock &PendingAt(int64_t pos) {
+		return pending_[static_cast<size_t>((pos - pending_.front().pos) / blockSize_)];
+	}
+	size_t MaxPending() {
+		return jobs_.size() * std::max(csoBlockSize_ / blockSize_, static_cast<uint32_t>(1)) + 1;
+	}
+
+	struct DecompressJob {
+		uv_work_t work;
+		bool busy = false;
+		// Uncompressed position and size of the input block.
+		int64_t pos = 0;
+		uint32_t size = 0;
+		const uint8_t *src = nullptr;
+		uint32_t len = 0;
+		bool isLZ4 = false;
+		// File position of src while it's still in a read slot, otherwise -1.
+		int64_t srcPos = -1;
+		// Set if src had to be copied out, because it was split between reads.
+		uint8_t *srcCopy = nullptr;
+		uint8_t *dst = nullptr;
+		// Set if the input block is larger than ours, and so is copied out afterward.
+		uint8_t *own = nullptr;
+		uint32_t resultSize = 0;
+		std::string error;
+	};
+	WorkerPool *workers_;
+	IoRing *ring_;
+	uint32_t decompressAhead_;
+	// These never move, since each may have work in flight.
+	std::vector<DecompressJob> jobs_;
+	uint32_t decompressing_;
+	int64_t decompressed_;
+
+	struct ReadSlot {
+		uv_fs_t req;
+		int64_t pos = 0;
+		uint32_t size = 0;
+		ssize_t result = 0;
+		bool inFlight = false;
+		// For compressed input, the file data.
+		uint8_t *data = nullptr;
+		// For ISO input, we read straight into the blocks.
+		std::vector<uint8_t *> blocks;
+		// Set if this is a hole in a sparse ISO, which isn't read at all.
+		bool hole = false;
+	};
+	ReadSlot &Slot(uint64_t n) {
+		return slots_[n % slots_.size()];
+	}
+
+	uint32_t readAhead_;
+	uint32_t readSize_;
+	// Slot numbers only go up, and wrap around slots_.  Those from firstSlot_ to nextSlot_ are in use.
+	std::vector<ReadSlot> slots_;
+	uint64_t firstSlot_;
+	uint64_t nextSlot_;
+	uint32_t inFlight_;
+	int64_t readPos_;
+	int64_t readEnd_;
+	// Set when ReadBlock() is waiting on a read or decompression to finish.
+	bool waiting_;
+
+	// For sparse ISOs, the next hole at or after readPos_.  Holes read as zeros, so we skip reading them.
+	bool sparse_;
+	int64_t holeStart_;
+	int64_t holeEnd_;
+	// Handed out as a mapped block for every block in a hole.
+	std::vector<uint8_t> zeroBlock_;
+
+	bool dropCache_;
+	// The whole file, if mapped.  Otherwise, reads go through slots_.
+	bool useMapping_;
+	uint8_t *map_;
+	int64_t mapSize_;
+
+	// Compressed data split across reads is joined here.
 	uint8_t *cache_;
-	int64_t cachePos_;
-	int32_t cacheSize_;
+	uint32_t cacheSize_;
 
-	std::string decompressError_;
-	uint32_t decompressResultSize_;
 	uint8_t csoIndexShift_;
 	uint8_t csoBlockShift_;
 	uint32_t csoBlockSize_;
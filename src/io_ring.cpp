@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "io_ring.h"
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NODROP)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+namespace maxcso {
+
+IoRing::IoRing(uv_loop_t *loop) : loop_(loop) {
+}
+
+IoRing::~IoRing() {
+	Close();
+}
+
+#ifdef HAVE_IO_URING
+
+static inline uint32_t LoadAcquire(const uint32_t *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void StoreRelease(uint32_t *p, uint32_t v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline uint8_t *At(void *base, uint32_t off) {
+	return static_cast<uint8_t *>(base) + off;
+}
+
+bool IoRing::Start(uint32_t entries) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (fd_ < 0) {
+		fd_ = -1;
+		return false;
+	}
+	// Without this, completions could be dropped if we fall behind.
+	if ((params.features & IORING_FEAT_NODROP) == 0) {
+		Close();
+		return false;
+	}
+
+	sqEntries_ = params.sq_entries;
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+	const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		sqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+	}
+
+	sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sqRing_ == MAP_FAILED) {
+		sqRing_ = nullptr;
+		Close();
+		return false;
+	}
+	if (single) {
+		cqRing_ = sqRing_;
+	} else {
+		cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED) {
+			cqRing_ = nullptr;
+			Close();
+			return false;
+		}
+	}
+	sqes_ = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes_ == MAP_FAILED) {
+		sqes_ = nullptr;
+		Close();
+		return false;
+	}
+
+	sqHead_ = reinterpret_cast<uint32_t *>(At(sqRing_, params.sq_off.head));
+	sqTail_ = reinterpret_cast<uint32_t *>(At(sqRing_, params.sq_off.tail));
+	sqMask_ = reinterpret_cast<uint32_t *>(At(sqRing_, params.sq_off.ring_mask));
+	sqArray_ = reinterpret_cast<uint32_t *>(At(sqRing_, params.sq_off.array));
+	cqHead_ = reinterpret_cast<uint32_t *>(At(cqRing_, params.cq_off.head));
+	cqTail_ = reinterpret_cast<uint32_t *>(At(cqRing_, params.cq_off.tail));
+	cqMask_ = reinterpret_cast<uint32_t *>(At(cqRing_, params.cq_off.ring_mask));
+	cqes_ = At(cqRing_, params.cq_off.cqes);
+
+	// Completions signal this, which the loop polls.
+	eventFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (eventFd_ < 0 || syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &eventFd_, 1) < 0) {
+		Close();
+		return false;
+	}
+
+	poll_ = new uv_poll_t;
+	uv_poll_init(loop_, poll_, eventFd_);
+	poll_->data = this;
+	uv_poll_start(poll_, UV_READABLE, [](uv_poll_t *handle, int status, int events) {
+		static_cast<IoRing *>(handle->data)->HandleCompletions();
+	});
+	// Only keep the loop alive when there's something in flight.
+	uv_unref(reinterpret_cast<uv_handle_t *>(poll_));
+
+	// Anything queued is submitted right before the loop waits.
+	prepare_ = new uv_prepare_t;
+	uv_prepare_init(loop_, prepare_);
+	prepare_->data = this;
+
+	started_ = true;
+	return true;
+}
+
+int IoRing::fs_read(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb) {
+	return Queue(IORING_OP_READV, req, file, bufs, nbufs, offset, std::move(cb));
+}
+
+int IoRing::fs_write(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb) {
+	return Queue(IORING_OP_WRITEV, req, file, bufs, nbufs, offset, std::move(cb));
+}
+
+int IoRing::Queue(uint8_t opcode, uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb) {
+	uint32_t tail = *sqTail_;
+	if (tail - LoadAcquire(sqHead_) >= sqEntries_) {
+		// Full, so send what we have now.  Without SQPOLL, the kernel takes them right away.
+		Submit();
+		if (tail - LoadAcquire(sqHead_) >= sqEntries_) {
+			return UV_EAGAIN;
+		}
+	}
+
+	// Looks like any other uv_fs_t to the callback, and uv_fs_req_cleanup() has nothing to free.
+	memset(req, 0, sizeof(*req));
+	req->type = UV_FS;
+	req->fs_type = opcode == IORING_OP_READV ? UV_FS_READ : UV_FS_WRITE;
+	req->loop = loop_;
+
+	Op *op = new Op{ req, std::move(cb), std::vector<uv_buf_t>(bufs, bufs + nbufs) };
+
+	const uint32_t index = tail & *sqMask_;
+	io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes_) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = file;
+	sqe->off = static_cast<uint64_t>(offset);
+	sqe->addr = reinterpret_cast<uint64_t>(op->bufs.data());
+	sqe->len = nbufs;
+	sqe->user_data = reinterpret_cast<uint64_t>(op);
+	sqArray_[index] = index;
+	StoreRelease(sqTail_, tail + 1);
+
+	if (queued_++ == 0) {
+		uv_prepare_start(prepare_, [](uv_prepare_t *handle) {
+			static_cast<IoRing *>(handle->data)->Submit();
+		});
+	}
+	if (inFlight_++ == 0) {
+		uv_ref(reinterpret_cast<uv_handle_t *>(poll_));
+	}
+	return 0;
+}
+
+void IoRing::Submit() {
+	while (queued_ != 0) {
+		const int result = static_cast<int>(syscall(__NR_io_uring_enter, fd_, queued_, 0, 0, nullptr, 0));
+		if (result < 0) {
+			// Try again next loop iteration, unless interrupted.
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		queued_ -= static_cast<uint32_t>(result);
+		if (result == 0) {
+			return;
+		}
+	}
+	uv_prepare_stop(prepare_);
+}
+
+void IoRing::HandleCompletions() {
+	uint64_t count;
+	if (read(eventFd_, &count, sizeof(count)) < 0) {
+		// Just means nothing new was signaled, we check the ring anyway.
+	}
+
+	for (;;) {
+		const uint32_t head = *cqHead_;
+		if (head == LoadAcquire(cqTail_)) {
+			break;
+		}
+
+		const io_uring_cqe *cqe = static_cast<const io_uring_cqe *>(cqes_) + (head & *cqMask_);
+		Op *op = reinterpret_cast<Op *>(cqe->user_data);
+		const int result = cqe->res;
+		StoreRelease(cqHead_, head + 1);
+
+		if (--inFlight_ == 0) {
+			uv_unref(reinterpret_cast<uv_handle_t *>(poll_));
+		}
+
+		// Errors are negative errno values, same as libuv uses.
+		uv_fs_t *req = op->req;
+		fs_func_cb cb = std::move(op->cb);
+		delete op;
+		req->result = result;
+		cb(req);
+	}
+}
+
+void IoRing::Close() {
+	if (started_) {
+		CloseAndDelete(poll_);
+		CloseAndDelete(prepare_);
+		poll_ = nullptr;
+		prepare_ = nullptr;
+		started_ = false;
+	}
+	if (eventFd_ >= 0) {
+		close(eventFd_);
+		eventFd_ = -1;
+	}
+	if (sqes_ != nullptr) {
+		munmap(sqes_, sqesSize_);
+		sqes_ = nullptr;
+	}
+	if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+		munmap(cqRing_, cqRingSize_);
+	}
+	cqRing_ = nullptr;
+	if (sqRing_ != nullptr) {
+		munmap(sqRing_, sqRingSize_);
+		sqRing_ = nullptr;
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+		fd_ = -1;
+	}
+}
+
+#else
+
+bool IoRing::Start(uint32_t entries) {
+	return false;
+}
+
+int IoRing::fs_read(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb) {
+	return UV_ENOSYS;
+}
+
+int IoRing::fs_write(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb) {
+	return UV_ENOSYS;
+}
+
+void IoRing::Close() {
+}
+
+#endif
+
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "uv_helper.h"
+
+namespace maxcso {
+
+// Reads and writes through Linux io_uring, rather than libuv's threadpool.
+// That saves a thread handoff per request, and everything queued during one loop iteration
+// is submitted together.  Callbacks run on the loop thread, with req->result set just like uv_fs_*.
+class IoRing {
+public:
+	IoRing(uv_loop_t *loop);
+	~IoRing();
+
+	// Returns false if io_uring isn't available (i.e. not Linux, or refused), and then it can't be used.
+	bool Start(uint32_t entries);
+
+	// Like UVHelper's.  The buffers may be reused once this returns, but not the data they point to.
+	// If these fail, cb is left as is, so the caller can fall back to UVHelper.
+	int fs_read(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb);
+	int fs_write(uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb);
+
+private:
+	struct Op {
+		uv_fs_t *req;
+		fs_func_cb cb;
+		// Same layout as iovec, and has to stay put until submitted.
+		std::vector<uv_buf_t> bufs;
+	};
+
+	int Queue(uint8_t opcode, uv_fs_t *req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset, fs_func_cb &&cb);
+	void Submit();
+	void HandleCompletions();
+	void Close();
+
+	uv_loop_t *loop_;
+	bool started_ = false;
+	// Allocated, since they finish closing after we're gone.
+	uv_poll_t *poll_ = nullptr;
+	uv_prepare_t *prepare_ = nullptr;
+
+	int fd_ = -1;
+	int eventFd_ = -1;
+	void *sqRing_ = nullptr;
+	void *cqRing_ = nullptr;
+	void *sqes_ = nullptr;
+	size_t sqRingSize_ = 0;
+	size_t cqRingSize_ = 0;
+	size_t sqesSize_ = 0;
+	uint32_t sqEntries_ = 0;
+
+	uint32_t *sqHead_ = nullptr;
+	uint32_t *sqTail_ = nullptr;
+	uint32_t *sqMask_ = nullptr;
+	uint32_t *sqArray_ = nullptr;
+	uint32_t *cqHead_ = nullptr;
+	uint32_t *cqTail_ = nullptr;
+	uint32_t *cqMask_ = nullptr;
+	void *cqes_ = nullptr;
+
+	// Not yet submitted, and not yet complete (including those not submitted.)
+	uint32_t queued_ = 0;
+	uint32_t inFlight_ = 0;
+};
+
+};
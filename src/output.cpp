@@ -1,21 +1,37 @@
+#include <algorithm>
 #include <cstring>
 #include "output.h"
 #include "buffer_pool.h"
 #include "compress.h"
 #include "cso.h"
 #include "dax.h"
+#include "file_cache.h"
+#include "io_ring.h"
 
 namespace maxcso {
 
 // TODO: Tune, less may be better.
 static const size_t QUEUE_SIZE = 32;
-
-Output::Output(uv_loop_t *loop, const Task &task)
-	: loop_(loop), flags_(task.flags), state_(STATE_INIT), fmt_(CSO_FMT_CSO1),
+// When decompressing, gather about this much before each write.
+static const uint32_t RAW_WRITE_SIZE = 1024 * 1024;
+// Otherwise, output is copied into chunks of this size, with several written at once.
+static const uint32_t WRITE_CHUNK_SIZE = 4 * 1024 * 1024;
+static const size_t WRITE_CHUNKS = 3;
+// With --drop-cache, written data is flushed and dropped once this much has collected.
+static const int64_t DROP_BEHIND_SIZE = 16 * 1024 * 1024;
+
+Output::Output(uv_loop_t *loop, WorkerPool *workers, BlockCache *cache, TrialCache *trialCache, const Task &task)
+	: task_(task), loop_(loop), workers_(workers), cache_(cache), trialCache_(trialCache), flags_(task.flags), state_(STATE_INIT), fmt_(CSO_FMT_CSO1),
 	origMaxCostPercent_(task.orig_max_cost_percent), lz4MaxCostPercent_(task.lz4_max_cost_percent),
-	srcSize_(-1), index_(nullptr) {
-	for (size_t i = 0; i < QUEUE_SIZE; ++i) {
-		freeSectors_.push_back(new Sector(flags_));
+	entropyThreshold_(task.entropy_threshold), stats_(), fills_(), srcSize_(-1), index_(nullptr),
+	fillChunk_(0), chunkPos_(0), writesInFlight_(0), writeFailed_(false), rawBatchSize_(0), rawBatchLast_(false), rawWriteBusy_(false) {
+	// Decompressing doesn't need any of the compression machinery.
+	if ((flags_ & TASKFLAG_DECOMPRESS) == 0) {
+		for (size_t i = 0; i < QUEUE_SIZE; ++i) {
+			freeSectors_.push_back(new Sector(flags_));
+		}
+		pendingSectors_.resize(QUEUE_SIZE, nullptr);
+		chunks_.resize(WRITE_CHUNKS);
 	}
 }
 
@@ -23,15 +39,17 @@ Output::~Output() {
 	for (Sector *sector : freeSectors_) {
 		delete sector;
 	}
-	for (auto pair : pendingSectors_) {
-		delete pair.second;
-	}
-	for (auto pair : partialSectors_) {
-		delete pair.second;
+	for (Sector *sector : pendingSectors_) {
+		delete sector;
 	}
 	freeSectors_.clear();
 	pendingSectors_.clear();
-	partialSectors_.clear();
+	for (OutputChunk &chunk : chunks_) {
+		delete [] chunk.data;
+		chunk.data = nullptr;
+	}
+	ReleaseRaw(rawBatch_);
+	ReleaseRaw(rawWriting_);
 
 	delete [] index_;
 	index_ = nullptr;
@@ -50,7 +68,9 @@ void Output::SetFile(uv_file file, int64_t srcSize, uint32_t blockSize, CSOForma
 
 	const uint32_t sectors = static_cast<uint32_t>((srcSize + blockSize_ - 1) >> blockShift_);
 	// Start after the header and index, which we'll fill in later.
-	index_ = new uint32_t[sectors + 1];
+	if ((flags_ & TASKFLAG_DECOMPRESS) == 0) {
+		index_ = new uint32_t[sectors + 1];
+	}
 	dstPos_ = DstFirstSectorPos(sectors);
 
 	// TODO: We might be able to optimize shift better by running through the data.
@@ -85,20 +105,26 @@ void Output::SetFile(uv_file file, int64_t srcSize, uint32_t blockSize, CSOForma
 	// But that would be > 4 TB anyway, so let's not worry about it.
 	indexAlign_ = 1 << indexShift_;
 	Align(dstPos_);
+	// The first sector goes where the index will say, after any padding.
+	chunkPos_ = dstPos_;
 
 	state_ |= STATE_HAS_FILE;
 
 	const uint32_t origMaxCost = static_cast<uint32_t>((origMaxCostPercent_ * blockSize_) / 100);
 	const uint32_t lz4MaxCost = static_cast<uint32_t>((lz4MaxCostPercent_ * blockSize_) / 100);
+	// DAX must compress every block, and FORCE_ALL means no heuristics.
+	double entropyThreshold = entropyThreshold_;
+	if ((flags_ & (TASKFLAG_FORCE_ALL | TASKFLAG_FMT_DAX)) != 0) {
+		entropyThreshold = 8.0;
+	}
 	for (Sector *sector : freeSectors_) {
-		sector->Setup(loop_, blockSize_, indexAlign_, origMaxCost, lz4MaxCost);
+		sector->Setup(workers_, blockSize_, indexAlign_, origMaxCost, lz4MaxCost, entropyThreshold, fills_, cache_, trialCache_, (flags_ & TASKFLAG_ADAPTIVE_TRIALS) != 0 ? &pruner_ : nullptr);
 	}
 }
 
 int64_t Output::DstFirstSectorPos(uint32_t totalSectors) {
 	if (flags_ & TASKFLAG_DECOMPRESS) {
-		// Decompressing, so no header.
-		// We still track the index for code simplicity, but throw it away.
+		// Decompressing, so no header or index.
 		return 0;
 	} else if (flags_ & TASKFLAG_FMT_DAX) {
 		// Pos (32 bits) and size (16 bits) per sector, plus header.
@@ -119,179 +145,351 @@ int32_t Output::Align(int64_t &pos) {
 	return 0;
 }
 
-void Output::Enqueue(int64_t pos, uint8_t *buffer) {
+void Output::Enqueue(int64_t pos, uint8_t *buffer, bool mapped) {
+	if (flags_ & TASKFLAG_DECOMPRESS) {
+		EnqueueRaw(pos, buffer, mapped);
+		return;
+	}
+
 	// We might not compress all blocks.
 	const bool tryCompress = ShouldCompress(pos, buffer);
 
-	const uint32_t block = static_cast<uint32_t>(pos >> blockShift_);
-
-	Sector *sector;
-	if (blockSize_ != SECTOR_SIZE) {
-		// Guaranteed to be zero-initialized on insert.
-		sector = partialSectors_[block];
-		if (sector == nullptr) {
-			sector = freeSectors_.back();
-			freeSectors_.pop_back();
-			partialSectors_[block] = sector;
-		}
-	} else {
-		sector = freeSectors_.back();
-		freeSectors_.pop_back();
-	}
+	Sector *sector = freeSectors_.back();
+	freeSectors_.pop_back();
 
 	if (!tryCompress) {
 		sector->DisableCompress();
 	}
-	sector->Process(pos, buffer, [this, sector, block](bool status, const char *reason) {
+	sector->Process(pos, buffer, mapped, [this, sector](bool status, const char *reason) {
 		if (!status) {
 			finish_(false, reason);
 			return;
 		}
-		if (blockSize_ != SECTOR_SIZE) {
-			// Not in progress anymore.
-			partialSectors_.erase(block);
-		}
+		CountSector(sector);
 		HandleReadySector(sector);
 	});
+}
+
+void Output::CountSector(Sector *sector) {
+	++stats_.blocks;
+	if (sector->Skipped()) {
+		++stats_.blocks_skipped;
+	}
+	if (sector->Filled()) {
+		++stats_.blocks_filled;
+	}
+	if (sector->Cached()) {
+		++stats_.blocks_cached;
+	}
+	stats_.trials_known += sector->KnownTrialsUsed();
+
+	BlockStats block;
+	sector->GetStats(block);
+	int64_t runnerUp = blockSize_;
+	for (int m = 0; m < TRIAL_METHOD_COUNT; ++m) {
+		MethodStats &method = stats_.methods[m];
+		if (block.trial_sizes[m] < 0) {
+			if (block.pruned & (1 << m)) {
+				++method.pruned;
+			}
+			continue;
+		}
 
-	// Only check for the last block of a larger block size.
-	if (blockSize_ != SECTOR_SIZE && pos + SECTOR_SIZE >= srcSize_) {
-		// Our src may not be aligned to the blockSize_, so this sector might never wake up.
-		// So let's send in some padding if needed.
-		const int64_t paddedSize = SrcSizeAligned() & ~static_cast<int64_t>(blockSize_ - 1);
-		for (int64_t padPos = srcSize_; padPos < paddedSize; padPos += SECTOR_SIZE) {
-			// Sector takes ownership, so we need a new one each time.
-			uint8_t *padBuffer = pool.Alloc();
-			memset(padBuffer, 0, SECTOR_SIZE);
-			sector->Process(padPos, padBuffer, [this, sector, block](bool status, const char *reason) {
-				if (!status) {
-					finish_(false, reason);
-					return;
-				}
-				partialSectors_.erase(block);
-				HandleReadySector(sector);
-			});
+		++method.trials;
+		method.cpu_ns += block.trial_ns[m];
+		if (block.trial_sizes[m] != 0) {
+			const int bucket = static_cast<int>(static_cast<int64_t>(block.trial_sizes[m]) * STATS_RATIO_BUCKETS / blockSize_);
+			++method.ratios[std::min(bucket, STATS_RATIO_BUCKETS - 1)];
+			if (m != block.winner) {
+				runnerUp = std::min(runnerUp, static_cast<int64_t>(block.trial_sizes[m]));
+			}
 		}
 	}
+	if (block.winner >= 0) {
+		++stats_.methods[block.winner].wins;
+		stats_.methods[block.winner].bytes_saved += runnerUp - block.trial_sizes[block.winner];
+	}
+
+	if (task_.block_stats) {
+		task_.block_stats(&task_, block);
+	}
 }
 
 void Output::HandleReadySector(Sector *sector) {
 	if (sector != nullptr) {
-		if (srcPos_ != sector->Pos()) {
-			// We're not there yet in the file stream.  Queue this, get to it later.
-			pendingSectors_[sector->Pos()] = sector;
-			return;
+		// It waits here for those before it, and for room to write.
+		PendingSlot(sector->Pos()) = sector;
+	}
+
+	// Copy out everything we can in order, so the sectors can be reused right away.
+	bool progressed = false;
+	for (;;) {
+		Sector *&slot = PendingSlot(srcPos_);
+		if (slot == nullptr || slot->Pos() != srcPos_ || !WriteSector(slot)) {
+			break;
 		}
-	} else {
-		// If no sector was provided, we're looking at the first in the queue.
-		if (pendingSectors_.empty()) {
-			return;
+		slot->Release();
+		freeSectors_.push_back(slot);
+		slot = nullptr;
+		progressed = true;
+	}
+
+	if (progressed) {
+		progress_(srcPos_, srcSize_, dstPos_);
+		CheckWritten();
+	}
+}
+
+bool Output::WriteSector(Sector *sector) {
+	if (writeFailed_) {
+		return false;
+	}
+
+	const uint32_t bestSize = sector->BestSize();
+	if (file_ >= 0 && !HasWriteRoom(bestSize + indexAlign_)) {
+		return false;
+	}
+	if (!UpdateIndex(srcPos_, dstPos_, bestSize, sector->Format())) {
+		writeFailed_ = true;
+		return false;
+	}
+
+	static const uint8_t padding[2048] = {0};
+	int64_t dstPos = dstPos_ + bestSize;
+	const int32_t padSize = Align(dstPos);
+	if (file_ >= 0) {
+		CopyToChunks(sector->BestBuffer(), bestSize);
+		CopyToChunks(padding, padSize);
+	}
+	dstPos_ = dstPos;
+	srcPos_ += blockSize_;
+
+	// If that was the last sector, then the index is ready to write.
+	if (srcPos_ >= srcSize_) {
+		// Update the final index entry.
+		const int32_t s = static_cast<int32_t>(SrcSizeAligned() >> blockShift_);
+		index_[s] = static_cast<int32_t>(dstPos_ >> indexShift_);
+
+		state_ |= STATE_INDEX_READY;
+		Flush();
+
+		if (file_ >= 0 && chunks_[fillChunk_].size != 0) {
+			WriteChunk(fillChunk_);
 		}
-		sector = pendingSectors_.begin()->second;
-		if (srcPos_ != sector->Pos()) {
-			return;
+	}
+	return true;
+}
+
+bool Output::HasWriteRoom(uint32_t size) {
+	const OutputChunk &chunk = chunks_[fillChunk_];
+	if (chunk.busy) {
+		return false;
+	}
+	const uint32_t room = chunk.size == 0 ? ChunkCapacity(dstPos_) : chunk.capacity - chunk.size;
+	// It might spill into the next chunk, which has to be free too.
+	return size <= room || !chunks_[(fillChunk_ + 1) % chunks_.size()].busy;
+}
+
+void Output::CopyToChunks(const uint8_t *src, uint32_t size) {
+	while (size != 0) {
+		OutputChunk &chunk = chunks_[fillChunk_];
+		if (chunk.size == 0) {
+			if (chunk.data == nullptr) {
+				chunk.data = new uint8_t[WRITE_CHUNK_SIZE];
+			}
+			chunk.pos = chunkPos_;
+			chunk.capacity = ChunkCapacity(chunkPos_);
 		}
 
-		// Remove it from the queue, and then run with it.
-		pendingSectors_.erase(pendingSectors_.begin());
-	}
-
-	// Check for any sectors that immediately follow the one we're writing.
-	// We'll just write them all together.
-	std::vector<Sector *> sectors;
-	sectors.push_back(sector);
-	static const size_t MAX_BUFS = 16;
-	int64_t nextPos = srcPos_ + blockSize_;
-	auto it = pendingSectors_.find(nextPos);
-	while (it != pendingSectors_.end()) {
-		sectors.push_back(it->second);
-		pendingSectors_.erase(it);
-		nextPos += blockSize_;
-		it = pendingSectors_.find(nextPos);
-
-		// Don't do more than MAX_BUFS at a time.
-		if (sectors.size() >= MAX_BUFS) {
-			break;
+		const uint32_t len = std::min(size, chunk.capacity - chunk.size);
+		memcpy(chunk.data + chunk.size, src, len);
+		chunk.size += len;
+		chunkPos_ += len;
+		src += len;
+		size -= len;
+
+		if (chunk.size == chunk.capacity) {
+			WriteChunk(fillChunk_);
+			fillChunk_ = (fillChunk_ + 1) % chunks_.size();
 		}
 	}
+}
 
-	int64_t dstPos = dstPos_;
-	uv_buf_t bufs[MAX_BUFS * 2];
-	unsigned int nbufs = 0;
-	static char padding[2048] = {0};
-	for (size_t i = 0; i < sectors.size(); ++i) {
-		unsigned int bestSize = sectors[i]->BestSize();
-		if (!UpdateIndex(sectors[i]->Pos(), dstPos, bestSize, sectors[i]->Format())) {
-			return;
-		}
+uint32_t Output::ChunkCapacity(int64_t pos) {
+	// End each chunk on a multiple of its size, so writes stay aligned after the first.
+	return WRITE_CHUNK_SIZE - static_cast<uint32_t>(pos % WRITE_CHUNK_SIZE);
+}
+
+void Output::WriteChunk(size_t i) {
+	OutputChunk &chunk = chunks_[i];
+	chunk.busy = true;
+	++writesInFlight_;
 
-		// In case there's padding in the compressed file, discard as needed.
-		if ((flags_ & TASKFLAG_DECOMPRESS) != 0 && dstPos + bestSize > srcSize_) {
-			bestSize = static_cast<unsigned int>(srcSize_ - dstPos);
+	const uv_buf_t buf = uv_buf_init(reinterpret_cast<char *>(chunk.data), chunk.size);
+	WriteData(&chunk.req, &buf, 1, chunk.pos, [this, &chunk](uv_fs_t *req) {
+		const bool success = req->result == static_cast<ssize_t>(chunk.size);
+		uv_fs_req_cleanup(req);
+		if (success) {
+			DropWritten(chunk.pos, chunk.size);
 		}
-		if (bestSize == 0) {
-			continue;
+
+		chunk.busy = false;
+		chunk.size = 0;
+		--writesInFlight_;
+
+		if (!success) {
+			if (!writeFailed_) {
+				writeFailed_ = true;
+				finish_(false, "Data could not be written to output file");
+			}
+			return;
 		}
 
-		bufs[nbufs++] = uv_buf_init(reinterpret_cast<char *>(sectors[i]->BestBuffer()), bestSize);
-		dstPos += bestSize;
-		int32_t padSize = Align(dstPos);
-		if (padSize != 0) {
-			// We need uv to write the padding out as well.
-			bufs[nbufs++] = uv_buf_init(padding, padSize);
+		// There may be sectors waiting for room.
+		HandleReadySector(nullptr);
+		CheckWritten();
+	});
+}
+
+void Output::WriteData(uv_fs_t *req, const uv_buf_t bufs[], unsigned int nbufs, int64_t pos, fs_func_cb &&cb) {
+	if (ring_ == nullptr || ring_->fs_write(req, file_, bufs, nbufs, pos, std::move(cb)) != 0) {
+		uv_.fs_write(loop_, req, file_, bufs, nbufs, pos, std::move(cb));
+	}
+}
+
+void Output::CheckWritten() {
+	if ((state_ & STATE_DATA_WRITTEN) || srcPos_ < srcSize_ || writesInFlight_ != 0) {
+		return;
+	}
+
+	state_ |= STATE_DATA_WRITTEN;
+	CheckFinish();
+}
+
+void Output::DropWritten(int64_t pos, int64_t len) {
+	if (!dropCache_) {
+		return;
+	}
+
+	// Chunks may finish out of order, but they're close together.  Dropping extra is harmless.
+	if (dropStart_ < 0) {
+		dropStart_ = pos;
+		dropEnd_ = pos + len;
+	} else {
+		dropStart_ = std::min(dropStart_, pos);
+		dropEnd_ = std::max(dropEnd_, pos + len);
+	}
+
+	if (!dropping_ && dropEnd_ - dropStart_ >= DROP_BEHIND_SIZE) {
+		StartDrop(dropStart_, dropEnd_ - dropStart_, false);
+		dropStart_ = -1;
+		dropEnd_ = -1;
+	}
+}
+
+void Output::StartDrop(int64_t pos, int64_t len, bool last) {
+	dropping_ = true;
+	const uv_file file = file_;
+	uv_.queue_work(loop_, &dropWork_, [file, pos, len](uv_work_t *req) {
+		FlushAndDropCached(file, pos, len);
+	}, [this, last](uv_work_t *req, int status) {
+		dropping_ = false;
+		if (last) {
+			state_ |= STATE_CACHE_DROPPED;
 		}
+		// The final drop waits for any before it.
+		CheckFinish();
+	});
+}
+
+void Output::EnqueueRaw(int64_t pos, uint8_t *buffer, bool mapped) {
+	// Input is in order, so there's nothing to sort out.  The last block may be padded.
+	const uint32_t size = static_cast<uint32_t>(std::min(static_cast<int64_t>(blockSize_), srcSize_ - pos));
+	rawBatch_.push_back(RawBlock{ buffer, size, mapped });
+	rawBatchSize_ += size;
+	if (pos + blockSize_ >= srcSize_) {
+		rawBatchLast_ = true;
 	}
 
-	// If we're working on the last sectors, then the index is ready to write.
-	if (nextPos >= srcSize_) {
-		// Update the final index entry.
-		const int32_t s = static_cast<int32_t>(SrcSizeAligned() >> blockShift_);
-		index_[s] = static_cast<int32_t>(dstPos >> indexShift_);
+	++stats_.blocks;
+	if (task_.block_stats) {
+		BlockStats block = {};
+		block.pos = pos;
+		block.size = size;
+		block.winner = -1;
+		std::fill(block.trial_sizes, block.trial_sizes + TRIAL_METHOD_COUNT, -1);
+		task_.block_stats(&task_, block);
+	}
+
+	if (!rawWriteBusy_ && (rawBatchSize_ >= RAW_WRITE_SIZE || rawBatchLast_)) {
+		WriteRaw();
+	}
+}
+
+void Output::WriteRaw() {
+	rawWriteBusy_ = true;
+	rawWriting_.swap(rawBatch_);
+	const int64_t totalWrite = rawBatchSize_;
+	rawBatchSize_ = 0;
 
+	if (rawBatchLast_) {
+		// No header or index to write when decompressing.
 		state_ |= STATE_INDEX_READY;
 		Flush();
 	}
 
-	const int64_t totalWrite = dstPos - dstPos_;
 	if (file_ < 0) {
-		HandleWrittenSectors(true, sectors, nextPos, totalWrite);
+		HandleRawWritten(true, totalWrite);
 		return;
 	}
 
-	uv_.fs_write(loop_, sector->WriteReq(), file_, bufs, nbufs, dstPos_, [this, sectors, nextPos, totalWrite](uv_fs_t *req) {
-		bool success = req->result == totalWrite;
+	std::vector<uv_buf_t> bufs;
+	bufs.reserve(rawWriting_.size());
+	for (const RawBlock &block : rawWriting_) {
+		bufs.push_back(uv_buf_init(reinterpret_cast<char *>(block.buffer), block.size));
+	}
+	WriteData(&rawWrite_, bufs.data(), static_cast<unsigned int>(bufs.size()), dstPos_, [this, totalWrite](uv_fs_t *req) {
+		const bool success = req->result == totalWrite;
 		uv_fs_req_cleanup(req);
 
-		HandleWrittenSectors(success, sectors, nextPos, totalWrite);
+		HandleRawWritten(success, totalWrite);
 		if (!success) {
 			finish_(false, "Data could not be written to output file");
-			return;
 		}
 	});
 }
 
-void Output::HandleWrittenSectors(bool success, const std::vector<Sector *> &sectors, int64_t nextPos, int64_t totalWrite) {
-	for (Sector *sector : sectors) {
-		sector->Release();
-		freeSectors_.push_back(sector);
-	}
+void Output::HandleRawWritten(bool success, int64_t totalWrite) {
+	ReleaseRaw(rawWriting_);
+	rawWriteBusy_ = false;
 
 	if (!success) {
 		return;
 	}
 
-	srcPos_ = nextPos;
+	if (file_ >= 0) {
+		DropWritten(dstPos_, totalWrite);
+	}
 	dstPos_ += totalWrite;
-
+	srcPos_ = dstPos_;
+	// This may resume input, and queue more blocks right away.
 	progress_(srcPos_, srcSize_, dstPos_);
 
-	if (nextPos >= srcSize_) {
+	if (srcPos_ >= srcSize_) {
 		state_ |= STATE_DATA_WRITTEN;
 		CheckFinish();
-	} else {
-		// Check if there's more data to write out.
-		HandleReadySector(nullptr);
+	} else if (!rawWriteBusy_ && (rawBatchSize_ >= RAW_WRITE_SIZE || rawBatchLast_)) {
+		WriteRaw();
+	}
+}
+
+void Output::ReleaseRaw(std::vector<RawBlock> &blocks) {
+	for (const RawBlock &block : blocks) {
+		if (!block.mapped) {
+			pool.Release(block.buffer);
+		}
 	}
+	blocks.clear();
 }
 
 bool Output::UpdateIndex(int64_t srcPos, int64_t dstPos, uint32_t compressedSize, SectorFormat compressedFmt) {
@@ -345,11 +543,15 @@ bool Output::ShouldCompress(int64_t pos, uint8_t *buffer) {
 		// TODO: This doesn't really seem to help anyone.  Rethink.
 		//return false;
 	}
-	// TODO
+	// Sector checks entropy once it has the whole block.
 	return true;
 }
 
 bool Output::QueueFull() {
+	if (flags_ & TASKFLAG_DECOMPRESS) {
+		// One batch writing, and the next one ready to go.
+		return rawBatchSize_ >= RAW_WRITE_SIZE;
+	}
 	return freeSectors_.empty();
 }
 
@@ -480,9 +682,18 @@ void Output::WriteDAXIndex() {
 }
 
 void Output::CheckFinish() {
-	if ((state_ & STATE_INDEX_WRITTEN) && (state_ & STATE_DATA_WRITTEN)) {
-		finish_(true, nullptr);
+	if (!(state_ & STATE_INDEX_WRITTEN) || !(state_ & STATE_DATA_WRITTEN)) {
+		return;
+	}
+
+	if (dropCache_ && file_ >= 0 && !(state_ & STATE_CACHE_DROPPED)) {
+		// Everything, including the header and index.  We're called again once it's done.
+		if (!dropping_) {
+			StartDrop(0, 0, true);
+		}
+		return;
 	}
+	finish_(true, nullptr);
 }
 
 inline int64_t Output::SrcSizeAligned() {
@@ -2,7 +2,6 @@
 
 #include <functional>
 #include <vector>
-#include <map>
 #include "uv_helper.h"
 #include "compress.h"
 #include "cso.h"
@@ -10,16 +9,26 @@
 
 namespace maxcso {
 
+class IoRing;
+
 typedef std::function<void (int64_t pos, int64_t total, int64_t written)> OutputCallback;
 typedef std::function<void (bool status, const char *reason)> OutputFinishCallback;
 
 class Output {
 public:
-	Output(uv_loop_t *loop, const Task &task);
+	Output(uv_loop_t *loop, WorkerPool *workers, BlockCache *cache, TrialCache *trialCache, const Task &task);
 	~Output();
 
+	// Write data through ring instead of the libuv threadpool, if not nullptr.  Call before SetFile().
+	void SetRing(IoRing *ring) {
+		ring_ = ring;
+	}
+	// Drop written data from the OS cache as we go, so it doesn't push out everything else.
+	void DropCache(bool enable) {
+		dropCache_ = enable;
+	}
 	void SetFile(uv_file file, int64_t srcSize, uint32_t blockSize, CSOFormat fmt);
-	void Enqueue(int64_t pos, uint8_t *buffer);
+	void Enqueue(int64_t pos, uint8_t *buffer, bool mapped);
 	bool QueueFull();
 
 	void OnProgress(OutputCallback callback);
@@ -28,14 +37,26 @@ class Output {
 	int64_t Written() {
 		return dstPos_;
 	}
+	const TaskStats &Stats() {
+		return stats_;
+	}
 
 private:
 	void CheckFinish();
 	void Flush();
 	void WriteCSOIndex();
 	void WriteDAXIndex();
+	void CountSector(Sector *sector);
 	void HandleReadySector(Sector *sector);
-	void HandleWrittenSectors(bool success, const std::vector<Sector *> &sectors, int64_t nextPos, int64_t totalWrite);
+	bool WriteSector(Sector *sector);
+	bool HasWriteRoom(uint32_t size);
+	void CopyToChunks(const uint8_t *src, uint32_t size);
+	uint32_t ChunkCapacity(int64_t pos);
+	void WriteChunk(size_t i);
+	void WriteData(uv_fs_t *req, const uv_buf_t bufs[], unsigned int nbufs, int64_t pos, fs_func_cb &&cb);
+	void CheckWritten();
+	void DropWritten(int64_t pos, int64_t len);
+	void StartDrop(int64_t pos, int64_t len, bool last);
 	bool ShouldCompress(int64_t pos, uint8_t *buffer);
 
 	int32_t Align(int64_t &pos);
@@ -50,15 +71,25 @@ class Output {
 		STATE_INDEX_READY = 0x02,
 		STATE_INDEX_WRITTEN = 0x04,
 		STATE_DATA_WRITTEN = 0x08,
+		STATE_CACHE_DROPPED = 0x10,
 	};
 
 	UVHelper uv_;
+	const Task &task_;
 	uv_loop_t *loop_;
+	WorkerPool *workers_;
+	IoRing *ring_ = nullptr;
+	BlockCache *cache_;
+	TrialCache *trialCache_;
 	uint32_t flags_;
 	uint32_t state_;
 	CSOFormat fmt_;
 	double origMaxCostPercent_;
 	double lz4MaxCostPercent_;
+	double entropyThreshold_;
+	TaskStats stats_;
+	FillResult fills_[256];
+	TrialPruner pruner_;
 
 	uv_file file_;
 	uv_fs_t flush_;
@@ -77,8 +108,54 @@ class Output {
 	OutputFinishCallback finish_;
 
 	std::vector<Sector *> freeSectors_;
-	std::map<int64_t, Sector *> pendingSectors_;
-	std::unordered_map<uint32_t, Sector *> partialSectors_;
+	// Finished sectors waiting for those before them, by block number.
+	// Every sector from srcPos_ on is in flight, so the queue size is always enough.
+	std::vector<Sector *> pendingSectors_;
+	Sector *&PendingSlot(int64_t pos) {
+		return pendingSectors_[static_cast<size_t>(pos >> blockShift_) % pendingSectors_.size()];
+	}
+
+	// Sectors are copied here once they're next in order, and written behind.
+	// These never move, since each may have a write in flight.
+	struct OutputChunk {
+		uv_fs_t req;
+		uint8_t *data = nullptr;
+		int64_t pos = 0;
+		uint32_t size = 0;
+		uint32_t capacity = 0;
+		bool busy = false;
+	};
+	std::vector<OutputChunk> chunks_;
+	size_t fillChunk_;
+	// Where the next byte copied into a chunk goes.
+	int64_t chunkPos_;
+	uint32_t writesInFlight_;
+	bool writeFailed_;
+
+	// Written, but not yet dropped from the cache.  Only one drop runs at a time.
+	bool dropCache_ = false;
+	bool dropping_ = false;
+	int64_t dropStart_ = -1;
+	int64_t dropEnd_ = -1;
+	uv_work_t dropWork_;
+
+	// When decompressing, blocks arrive in order and go straight out in large writes.
+	struct RawBlock {
+		uint8_t *buffer;
+		uint32_t size;
+		bool mapped;
+	};
+	void EnqueueRaw(int64_t pos, uint8_t *buffer, bool mapped);
+	void WriteRaw();
+	void HandleRawWritten(bool success, int64_t totalWrite);
+	void ReleaseRaw(std::vector<RawBlock> &blocks);
+
+	std::vector<RawBlock> rawBatch_;
+	std::vector<RawBlock> rawWriting_;
+	uint32_t rawBatchSize_;
+	bool rawBatchLast_;
+	bool rawWriteBusy_;
+	uv_fs_t rawWrite_;
 };
 
 };
@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include "sector.h"
 #include "compress.h"
 #include "cso.h"
 #include "buffer_pool.h"
+#include "codecs.h"
 #include "zopfli/zopfli.h"
 #include "libdeflate.h"
 #ifndef NO_DEFLATE7Z
@@ -15,119 +18,159 @@
 
 namespace maxcso {
 
-static bool AddZlib(std::vector<z_stream *> &list, int strategy, bool withHeader) {
-	z_stream *z = reinterpret_cast<z_stream *>(calloc(1, sizeof(z_stream)));
-	int result = deflateInit2(z, 9, Z_DEFLATED, withHeader ? 15 : -15, 9, strategy);
-	if (result != Z_OK) {
-		free(z);
-		return false;
-	}
+// Roughly how slow each method is, used to run the cheapest first.
+static const int TRIAL_COST[TRIAL_METHOD_COUNT] = {
+	5, // TRIAL_ZLIB_DEFAULT
+	6, // TRIAL_ZLIB_FILTERED
+	3, // TRIAL_ZLIB_HUFFMAN
+	4, // TRIAL_ZLIB_RLE
+	12, // TRIAL_ZOPFLI
+	11, // TRIAL_7ZIP
+	10, // TRIAL_LIBDEFLATE
+	1, // TRIAL_LZ4HC_4
+	2, // TRIAL_LZ4HC_7
+	7, // TRIAL_LZ4HC_10
+	8, // TRIAL_LZ4HC_13
+	9, // TRIAL_LZ4HC_16
+	0, // TRIAL_LZ4
+};
 
-	list.push_back(z);
-	return true;
-}
+// Order-0 entropy of the data, in bits per byte.
+static double EstimateEntropy(const uint8_t *p, uint32_t len) {
+	// Interleaving four histograms avoids stalls when the same byte repeats.
+	uint32_t counts[4][256] = {};
+	uint32_t i = 0;
+	for (; i + 4 <= len; i += 4) {
+		++counts[0][p[i + 0]];
+		++counts[1][p[i + 1]];
+		++counts[2][p[i + 2]];
+		++counts[3][p[i + 3]];
+	}
+	for (; i < len; ++i) {
+		++counts[0][p[i]];
+	}
+
+	double sum = 0.0;
+	int used = 0;
+	for (int c = 0; c < 256; ++c) {
+		const uint32_t n = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+		if (n != 0) {
+			sum += n * std::log2(static_cast<double>(n));
+			++used;
+		}
+	}
 
-static void EndZlib(z_stream *&z) {
-	deflateEnd(z);
-	free(z);
-	z = nullptr;
+	const double entropy = std::log2(static_cast<double>(len)) - sum / len;
+	// Small blocks underestimate, so apply the Miller-Madow correction.
+	// Otherwise random data in a 2048 byte block would look like only ~7.91 bits.
+	return entropy + (used - 1) / (2.0 * len * std::log(2.0));
 }
 
 Sector::Sector(uint32_t flags)
 	: flags_(flags) {
-	// Set up the zlib streams, which we will reuse each time we hit this sector.
-	bool withHeader = (flags_ & TASKFLAG_FMT_DAX) != 0;
+	ResetTrialStats();
+
+	// The compressors themselves belong to the worker threads (see Codecs.)
 	if (!(flags_ & TASKFLAG_NO_ZLIB_DEFAULT)) {
-		AddZlib(zStreams_, Z_DEFAULT_STRATEGY, withHeader);
+		trials_.push_back(TRIAL_ZLIB_DEFAULT);
 	}
 	if (!(flags_ & TASKFLAG_NO_ZLIB_BRUTE)) {
-		AddZlib(zStreams_, Z_FILTERED, withHeader);
-		AddZlib(zStreams_, Z_HUFFMAN_ONLY, withHeader);
-		AddZlib(zStreams_, Z_RLE, withHeader);
+		// Each of these sometimes wins on certain blocks.
+		trials_.push_back(TRIAL_ZLIB_FILTERED);
+		trials_.push_back(TRIAL_ZLIB_HUFFMAN);
+		trials_.push_back(TRIAL_ZLIB_RLE);
 	}
-
-	if (!(flags_ & TASKFLAG_NO_LIBDEFLATE)) {
-		libdeflate_ = libdeflate_alloc_compressor(12);
+	if (!(flags_ & TASKFLAG_NO_ZOPFLI)) {
+		trials_.push_back(TRIAL_ZOPFLI);
 	}
 
 #ifndef NO_DEFLATE7Z
 	if (!(flags_ & TASKFLAG_NO_7ZIP)) {
-		Deflate7z::Options opts;
-		Deflate7z::SetDefaults(&opts);
-		opts.level = 9;
-		opts.passes = 12;
-		opts.fastbytes = 64;
-		opts.matchcycles = 32;
-		opts.algo = 1;
-		opts.useZlib = (flags_ & TASKFLAG_FMT_DAX) != 0;
-		Deflate7z::Alloc(&deflate7z_, &opts);
+		trials_.push_back(TRIAL_7ZIP);
 	}
 #endif
-}
 
-Sector::~Sector() {
-	// Maybe should throw an error if it wasn't released?
-	Release();
-
-	for (z_stream *&z : zStreams_) {
-		EndZlib(z);
+	if (!(flags_ & TASKFLAG_NO_LIBDEFLATE)) {
+		trials_.push_back(TRIAL_LIBDEFLATE);
 	}
 
-	if (libdeflate_) {
-		libdeflate_free_compressor(libdeflate_);
+	if (!(flags_ & (TASKFLAG_NO_LZ4_HC | TASKFLAG_NO_LZ4_HC_BRUTE))) {
+		// Sometimes lower levels can actually win.  But, usually not, so only try a few.
+		const bool allowBrute = !(flags_ & TASKFLAG_NO_LZ4_HC_BRUTE);
+		for (int t = allowBrute ? TRIAL_LZ4HC_4 : TRIAL_LZ4HC_16; t <= TRIAL_LZ4HC_16; ++t) {
+			trials_.push_back(static_cast<TrialMethod>(t));
+		}
+	}
+	if (!(flags_ & TASKFLAG_NO_LZ4_DEFAULT)) {
+		trials_.push_back(TRIAL_LZ4);
 	}
 
-#ifndef NO_DEFLATE7Z
-	if (!(flags_ & TASKFLAG_NO_7ZIP)) {
-		Deflate7z::Release(&deflate7z_);
+	runOrder_ = trials_;
+	std::stable_sort(runOrder_.begin(), runOrder_.end(), [](TrialMethod a, TrialMethod b) {
+		return TRIAL_COST[a] < TRIAL_COST[b];
+	});
+
+	if ((flags_ & TASKFLAG_SPLIT_TRIALS) && trials_.size() > 1) {
+		trialWork_.resize(trials_.size());
+		trialResults_.resize(trials_.size());
 	}
-#endif
 }
 
-void Sector::Process(int64_t pos, uint8_t *buffer, SectorCallback ready) {
-	if (!busy_) {
-		busy_ = true;
-
-		pos_ = pos & ~static_cast<uint64_t>(blockSize_ - 1);
-		bestSize_ = blockSize_;
-		bestFmt_ = SECTOR_FMT_ORIG;
+Sector::~Sector() {
+	// Maybe should throw an error if it wasn't released?
+	Release();
+}
 
-		if (blockSize_ == SECTOR_SIZE) {
-			buffer_ = buffer;
-		} else {
-			buffer_ = pool.Alloc();
-			memcpy(buffer_ + pos - pos_, buffer, SECTOR_SIZE);
+void Sector::Process(int64_t pos, uint8_t *buffer, bool mapped, SectorCallback ready) {
+	if (busy_) {
+		ready(false, "Sector already waiting for queued operation");
+		if (!mapped) {
 			pool.Release(buffer);
 		}
-	} else if (static_cast<uint64_t>(pos - pos_) < pool.bufferSize) {
-		memcpy(buffer_ + pos - pos_, buffer, SECTOR_SIZE);
-		pool.Release(buffer);
-	} else {
-		ready_(false, "Invalid buffer pos for this sector block");
 		return;
 	}
 
-	readySize_ += SECTOR_SIZE;
-	if (readySize_ < blockSize_) {
-		// We can't process yet, wait for the other buffers.
-		return;
-	}
+	// Input hands us the whole block at once, so we just take it.
+	busy_ = true;
+	pos_ = pos;
+	buffer_ = buffer;
+	bufferMapped_ = mapped;
+	bestSize_ = blockSize_;
+	bestFmt_ = SECTOR_FMT_ORIG;
 
-	if (enqueued_) {
-		ready_(false, "Sector already waiting for queued operation");
-		return;
-	}
-
-	if (compress_) {
-		enqueued_ = true;
+	if (compress_ && UseFill()) {
+		ready(true, nullptr);
+	} else if (compress_) {
 		ready_ = ready;
-		uv_.queue_work(loop_, &work_, [this](uv_work_t *req) {
-			Compress();
-			FinalizeBest(align_);
+		if (pruner_ != nullptr) {
+			pruned_ = pruner_->NextSkipMask(trials_);
+		}
+		const bool checkEntropy = entropyThreshold_ < 8.0;
+		if (!trialWork_.empty() && !checkEntropy && cache_ == nullptr && trialCache_ == nullptr) {
+			CompressSplit();
+			return;
+		}
+		workers_->queue_work(&work_, [this, checkEntropy](uv_work_t *req) {
+			// Check entropy first, so the cache never changes which blocks get skipped.
+			if (checkEntropy && LooksIncompressible()) {
+				skipped_ = true;
+			} else if (cache_ != nullptr && LookupCache()) {
+				cached_ = true;
+			} else {
+				LoadKnownTrials();
+				if (trialWork_.empty()) {
+					Compress();
+					FinalizeBest(align_);
+				}
+			}
 		}, [this](uv_work_t *req, int status) {
 			if (status < 0) {
 				ready_(false, "Failed to compress sector");
+			} else if (!skipped_ && !cached_ && !trialWork_.empty()) {
+				// Now that we know it's worth it, run each trial separately.
+				CompressSplit();
 			} else {
+				Remember();
 				ready_(true, nullptr);
 			}
 		});
@@ -148,65 +191,407 @@ void Sector::FinalizeBest(uint32_t align) {
 			bestFmt_ = SECTOR_FMT_ORIG;
 		}
 	}
+	if (best_ == nullptr) {
+		bestMethod_ = -1;
+	}
+}
+
+bool Sector::LooksIncompressible() {
+	if (EstimateEntropy(buffer_, blockSize_) < entropyThreshold_) {
+		return false;
+	}
+
+	// Repeated runs of high entropy data (like tables) would still compress well.
+	// A fast lz4 pass will find those matches cheaply, and then we run the real trials.
+	Codecs *codecs = WorkerPool::ThreadCodecs();
+	uint8_t *probe = codecs->Scratch(TRIAL_LZ4, blockSize_ * 2);
+	const int probeSize = LZ4_compress_default(reinterpret_cast<const char *>(buffer_), reinterpret_cast<char *>(probe), blockSize_, codecs->ScratchSize(TRIAL_LZ4));
+	return probeSize == 0 || static_cast<uint32_t>(probeSize) >= blockSize_ - blockSize_ / 32;
 }
 
 void Sector::Compress() {
-	// Each of these sometimes wins on certain blocks.
-	for (z_stream *const z : zStreams_) {
-		ZlibTrial(z);
+	// Run the cheapest first, so their results can cap the slower ones.
+	// Then submit in the usual order, so ties resolve the same way.
+	// Trials write to this thread's scratch buffers, and only the winner's is kept.
+	Codecs *codecs = WorkerPool::ThreadCodecs();
+	TrialResult results[TRIAL_METHOD_COUNT] = {};
+	for (TrialMethod method : runOrder_) {
+		TrialResult &result = results[method];
+		// Same as the pool's size for our block size, at least.
+		uint8_t *out = codecs->Scratch(method, blockSize_ * 2);
+		if (!UseKnownTrial(method, out, codecs->ScratchSize(method), result)) {
+			if (Pruned(method)) {
+				continue;
+			}
+			// Another task may grow the pool meanwhile, so stay within this buffer.
+			const uint32_t outSize = codecs->ScratchSize(method);
+			RunTrial(method, out, outSize, TrialCap(method, outSize, results), result);
+			AddKnownTrial(method, result);
+		}
 	}
-	if (!(flags_ & TASKFLAG_NO_ZOPFLI)) {
-		ZopfliTrial();
+
+	for (TrialMethod method : trials_) {
+		TrialResult &result = results[method];
+		if (result.buffer != nullptr && SubmitTrial(result.size, result.fmt)) {
+			bestMethod_ = method;
+		}
 	}
-	if (!(flags_ & TASKFLAG_NO_7ZIP)) {
-		SevenZipTrial();
+	if (bestMethod_ != -1) {
+		best_ = codecs->TakeScratch(static_cast<TrialMethod>(bestMethod_));
 	}
-	if (!(flags_ & TASKFLAG_NO_LIBDEFLATE)) {
-		LibDeflateTrial();
+	SaveKnownTrials();
+}
+
+uint32_t Sector::TrialCap(TrialMethod method, uint32_t outSize, const TrialResult *results) {
+	// Saved results must be complete, since other settings may pick a different winner.
+	if (trialCache_ != nullptr) {
+		return outSize;
 	}
-	if (!(flags_ & (TASKFLAG_NO_LZ4_HC | TASKFLAG_NO_LZ4_HC_BRUTE))) {
-		LZ4HCTrial(!(flags_ & TASKFLAG_NO_LZ4_HC_BRUTE));
+
+	const bool lz4 = method >= TRIAL_LZ4HC_4;
+	uint64_t cap = outSize;
+	if (!(flags_ & TASKFLAG_FMT_DAX)) {
+		// Deflate can't win without beating uncompressed, and lz4 can't go too far past that.
+		if (lz4) {
+			cap = std::min(cap, static_cast<uint64_t>(blockSize_) - 1 + lz4MaxCost_);
+		} else {
+			cap = std::min(cap, origMaxCost_ >= blockSize_ ? 0 : static_cast<uint64_t>(blockSize_) - 1 - origMaxCost_);
+		}
 	}
-	if (!(flags_ & TASKFLAG_NO_LZ4_DEFAULT)) {
-		LZ4Trial();
+
+	// With no orig cost, only the smallest of each format can win.  Anything else can't change
+	// the result, no matter the order.  Allow ties, since this one might be submitted first.
+	if (origMaxCost_ == 0 && results != nullptr) {
+		for (TrialMethod other : trials_) {
+			const TrialResult &result = results[other];
+			if (result.buffer != nullptr && (result.fmt == SECTOR_FMT_LZ4) == lz4) {
+				cap = std::min(cap, static_cast<uint64_t>(result.size));
+			}
+		}
+	}
+	return static_cast<uint32_t>(cap);
+}
+
+void Sector::CompressSplit() {
+	// Each trial gets its own job.  We keep all the results and then submit them in order,
+	// so that ties resolve exactly the same way as Compress().
+	trialsLeft_ = trials_.size();
+	trialFailed_ = false;
+	for (size_t i = 0; i < trials_.size(); ++i) {
+		// These results are kept past the job, so they can't use scratch buffers.
+		// Another task may change the pool's size before the job runs, so remember this one's.
+		uint8_t *out = pool.Alloc();
+		const uint32_t outSize = BufferPool::SizeOf(out);
+		if (UseKnownTrial(trials_[i], out, outSize, trialResults_[i]) || Pruned(trials_[i])) {
+			if (trialResults_[i].buffer == nullptr) {
+				pool.Release(out);
+			}
+			--trialsLeft_;
+			continue;
+		}
+		workers_->queue_work(&trialWork_[i], [this, i, out, outSize](uv_work_t *req) {
+			// Other trials are running at the same time, so we can't use their results.
+			RunTrial(trials_[i], out, outSize, TrialCap(trials_[i], outSize, nullptr), trialResults_[i]);
+			if (trialResults_[i].buffer == nullptr) {
+				pool.Release(out);
+			}
+		}, [this](uv_work_t *req, int status) {
+			if (status < 0) {
+				trialFailed_ = true;
+			}
+			if (--trialsLeft_ == 0) {
+				FinishSplit();
+			}
+		});
+	}
+
+	if (trialsLeft_ == 0) {
+		// Everything was already known.
+		FinishSplit();
+	}
+}
+
+void Sector::FinishSplit() {
+	if (!trialFailed_ && trialCache_ != nullptr) {
+		for (size_t i = 0; i < trials_.size(); ++i) {
+			if (!HasKnownTrial(trials_[i]) && !Pruned(trials_[i])) {
+				AddKnownTrial(trials_[i], trialResults_[i]);
+			}
+		}
+		// This blocks the loop thread a little, but it's a single small write.
+		SaveKnownTrials();
+	}
+
+	int winner = -1;
+	for (size_t i = 0; i < trialResults_.size(); ++i) {
+		const TrialResult &result = trialResults_[i];
+		if (result.buffer != nullptr && !trialFailed_ && SubmitTrial(result.size, result.fmt)) {
+			winner = static_cast<int>(i);
+		}
+	}
+	for (size_t i = 0; i < trialResults_.size(); ++i) {
+		TrialResult &result = trialResults_[i];
+		if (static_cast<int>(i) == winner) {
+			best_ = result.buffer;
+			bestMethod_ = trials_[i];
+		} else if (result.buffer != nullptr) {
+			pool.Release(result.buffer);
+		}
+		result.buffer = nullptr;
+	}
+
+	if (trialFailed_) {
+		ready_(false, "Failed to compress sector");
+	} else {
+		FinalizeBest(align_);
+		Remember();
+		ready_(true, nullptr);
 	}
 }
 
+bool Sector::UseFill() {
+	if (fills_ == nullptr) {
+		return false;
+	}
+
+	// Comparing against itself shifted by one checks every byte is the same, and memcmp is fast.
+	if (memcmp(buffer_, buffer_ + 1, blockSize_ - 1) != 0) {
+		return false;
+	}
+
+	fillByte_ = buffer_[0];
+	const FillResult &fill = fills_[fillByte_];
+	if (!fill.known) {
+		// We'll compress it this time, and remember for later.
+		return false;
+	}
+	if (!fill.complete && pruner_ != nullptr && pruner_->NextIsSample()) {
+		// This block will run every trial, so let it improve on the pruned result.
+		return false;
+	}
+
+	if (fill.fmt != SECTOR_FMT_ORIG) {
+		best_ = pool.Alloc();
+		memcpy(best_, fill.data.data(), fill.data.size());
+		bestSize_ = static_cast<uint32_t>(fill.data.size());
+		bestFmt_ = fill.fmt;
+	}
+	filled_ = true;
+	return true;
+}
+
+void Sector::RememberFill() {
+	if (fillByte_ < 0) {
+		return;
+	}
+
+	FillResult &fill = fills_[fillByte_];
+	if (!fill.known || (!fill.complete && pruned_ == 0)) {
+		fill.known = true;
+		fill.complete = pruned_ == 0;
+		fill.fmt = bestFmt_;
+		if (best_ != nullptr) {
+			fill.data.assign(best_, best_ + bestSize_);
+		} else {
+			fill.data.clear();
+		}
+	}
+}
+
+void Sector::HashBlock() {
+	if (!hashed_) {
+		BlockCache::HashBlock(cacheKey_, buffer_, blockSize_);
+		hashed_ = true;
+	}
+}
+
+bool Sector::LookupCache() {
+	cacheKey_.blockSize = blockSize_;
+	cacheKey_.flags = flags_;
+	cacheKey_.align = align_;
+	cacheKey_.origMaxCost = origMaxCost_;
+	cacheKey_.lz4MaxCost = lz4MaxCost_;
+	HashBlock();
+
+	uint8_t *out = pool.Alloc();
+	uint32_t size;
+	SectorFormat fmt;
+	if (!cache_->Lookup(cacheKey_, out, size, fmt)) {
+		pool.Release(out);
+		return false;
+	}
+
+	if (fmt == SECTOR_FMT_ORIG) {
+		pool.Release(out);
+	} else {
+		best_ = out;
+		bestSize_ = size;
+		bestFmt_ = fmt;
+	}
+	return true;
+}
+
+// Called on the loop thread once we have the final result.
+void Sector::Remember() {
+	RememberFill();
+	if (pruner_ != nullptr && !skipped_ && !cached_) {
+		pruner_->Record(trialSizes_, bestMethod_);
+	}
+	if (cache_ != nullptr && !skipped_ && !cached_) {
+		cache_->Insert(cacheKey_, best_, best_ == nullptr ? 0 : bestSize_, bestFmt_);
+	}
+}
+
+TrialCache::Key Sector::KnownTrialsKey() {
+	// Costs and other formats don't change trial output, only which one wins.
+	const uint32_t variant = (flags_ & TASKFLAG_FMT_DAX) != 0 ? 1 : 0;
+	return TrialCache::Key{ { cacheKey_.hash[0], cacheKey_.hash[1] }, blockSize_, variant };
+}
+
+void Sector::LoadKnownTrials() {
+	if (trialCache_ == nullptr) {
+		return;
+	}
+
+	HashBlock();
+	trialCache_->Load(KnownTrialsKey(), known_);
+}
+
+bool Sector::HasKnownTrial(TrialMethod method) {
+	for (const KnownTrial &trial : known_) {
+		if (trial.method == static_cast<uint32_t>(method)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Sector::UseKnownTrial(TrialMethod method, uint8_t *out, uint32_t outSize, TrialResult &result) {
+	for (const KnownTrial &trial : known_) {
+		if (trial.method != static_cast<uint32_t>(method) || trial.data.size() > outSize) {
+			continue;
+		}
+
+		result.buffer = nullptr;
+		if (!trial.data.empty()) {
+			memcpy(out, trial.data.data(), trial.data.size());
+			const SectorFormat fmt = method >= TRIAL_LZ4HC_4 ? SECTOR_FMT_LZ4 : SECTOR_FMT_DEFLATE;
+			result = TrialResult{ out, static_cast<uint32_t>(trial.data.size()), fmt };
+		}
+		trialSizes_[method] = static_cast<int32_t>(trial.data.size());
+		trialNs_[method] = 0;
+		++knownUsed_;
+		return true;
+	}
+	return false;
+}
+
+void Sector::AddKnownTrial(TrialMethod method, const TrialResult &result) {
+	if (trialCache_ == nullptr) {
+		return;
+	}
+
+	known_.push_back(KnownTrial{ static_cast<uint32_t>(method), std::vector<uint8_t>() });
+	if (result.buffer != nullptr) {
+		known_.back().data.assign(result.buffer, result.buffer + result.size);
+	}
+	knownChanged_ = true;
+}
+
+void Sector::SaveKnownTrials() {
+	if (knownChanged_) {
+		trialCache_->Store(KnownTrialsKey(), known_);
+	}
+}
+
+void Sector::GetStats(BlockStats &stats) {
+	stats.pos = pos_;
+	stats.size = bestSize_;
+	stats.compressed = best_ != nullptr;
+	stats.skipped = skipped_;
+	stats.filled = filled_;
+	stats.cached = cached_;
+	stats.winner = bestMethod_;
+	stats.pruned = skipped_ || cached_ ? 0 : pruned_;
+	std::copy(trialSizes_, trialSizes_ + TRIAL_METHOD_COUNT, stats.trial_sizes);
+	std::copy(trialNs_, trialNs_ + TRIAL_METHOD_COUNT, stats.trial_ns);
+}
+
+void Sector::ResetTrialStats() {
+	bestMethod_ = -1;
+	std::fill(trialSizes_, trialSizes_ + TRIAL_METHOD_COUNT, -1);
+	std::fill(trialNs_, trialNs_ + TRIAL_METHOD_COUNT, 0);
+}
+
+void Sector::RunTrial(TrialMethod method, uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result) {
+	const uint64_t start = uv_hrtime();
+	result.buffer = nullptr;
+	switch (cap == 0 ? TRIAL_METHOD_COUNT : method) {
+	case TRIAL_ZLIB_DEFAULT:
+	case TRIAL_ZLIB_FILTERED:
+	case TRIAL_ZLIB_HUFFMAN:
+	case TRIAL_ZLIB_RLE:
+		ZlibTrial(WorkerPool::ThreadCodecs()->Zlib(method - TRIAL_ZLIB_DEFAULT, (flags_ & TASKFLAG_FMT_DAX) != 0), out, outSize, cap, result);
+		break;
+	case TRIAL_ZOPFLI:
+		ZopfliTrial(out, cap, result);
+		break;
+	case TRIAL_7ZIP:
+		SevenZipTrial(out, cap, result);
+		break;
+	case TRIAL_LIBDEFLATE:
+		LibDeflateTrial(out, outSize, cap, result);
+		break;
+	case TRIAL_LZ4HC_4:
+	case TRIAL_LZ4HC_7:
+	case TRIAL_LZ4HC_10:
+	case TRIAL_LZ4HC_13:
+	case TRIAL_LZ4HC_16:
+		LZ4HCTrial(4 + 3 * (method - TRIAL_LZ4HC_4), out, cap, result);
+		break;
+	case TRIAL_LZ4:
+		LZ4Trial(out, cap, result);
+		break;
+	default:
+		break;
+	}
+
+	trialSizes_[method] = result.buffer == nullptr ? 0 : static_cast<int32_t>(result.size);
+	trialNs_[method] = uv_hrtime() - start;
+}
+
 // TODO: Split these out to separate files?
-void Sector::ZlibTrial(z_stream *z) {
+void Sector::ZlibTrial(z_stream *z, uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result) {
 	// TODO: Validate the benefit of these with raw on msvc and gcc.
 	// Try TOO_FAR?  Trialing 3 different values gives ~0.0002% and requires zlib patching...
 	// http://jsnell.iki.fi/blog/
 	// https://github.com/jtkukunas/zlib
 	// https://github.com/cloudflare/zlib
 
-	if (deflateReset(z)) {
+	if (z == nullptr || deflateReset(z)) {
 		return;
 	}
 
 	z->next_in = buffer_;
 	z->avail_in = blockSize_;
 
-	uint8_t *result = pool.Alloc();
-
-	z->next_out = result;
-	z->avail_out = pool.bufferSize;
+	// A spare byte, so an exact fit isn't mistaken for running out of space.
+	z->next_out = out;
+	z->avail_out = std::min(cap + 1, outSize);
 
 	int res;
 	while ((res = deflate(z, Z_FINISH)) == Z_OK) {
 		continue;
 	}
-	if (res == Z_STREAM_END) {
+	if (res == Z_STREAM_END && z->total_out <= cap) {
 		// Success.  Let's check the size.
-		SubmitTrial(result, z->total_out, SECTOR_FMT_DEFLATE);
-	} else {
-		// Failed, just ignore this result.
-		// TODO: Log or something?
-		pool.Release(result);
+		result = TrialResult{ out, static_cast<uint32_t>(z->total_out), SECTOR_FMT_DEFLATE };
 	}
+	// Otherwise, failed, just ignore this result.
+	// TODO: Log or something?
 }
 
-void Sector::ZopfliTrial() {
+void Sector::ZopfliTrial(uint8_t *out, uint32_t cap, TrialResult &result) {
 	// TODO: Trial blocksplittinglast and blocksplittingmax?
 	// Increase numiterations depending on how long it takes?
 	// TODO: Should this be static otherwise?
@@ -217,75 +602,66 @@ void Sector::ZopfliTrial() {
 
 	// Grr, zopfli doesn't allow us to use a fixed-size buffer.
 	// Also doesn't return failure?
-	unsigned char *out = nullptr;
+	unsigned char *zout = nullptr;
 	size_t outsize = 0;
 	ZopfliFormat fmt = (flags_ & TASKFLAG_FMT_DAX) != 0 ? ZOPFLI_FORMAT_ZLIB : ZOPFLI_FORMAT_DEFLATE;
-	ZopfliCompress(&opt, fmt, buffer_, blockSize_, &out, &outsize);
-	if (out != nullptr) {
-		if (outsize > 0 && outsize < static_cast<size_t>(pool.bufferSize)) {
+	ZopfliCompress(&opt, fmt, buffer_, blockSize_, &zout, &outsize);
+	if (zout != nullptr) {
+		if (outsize > 0 && outsize <= static_cast<size_t>(cap)) {
 			// So that we have proper release semantics, we copy to our buffer.
-			uint8_t *result = pool.Alloc();
-			memcpy(result, out, outsize);
-			SubmitTrial(result, static_cast<uint32_t>(outsize), SECTOR_FMT_DEFLATE);
+			memcpy(out, zout, outsize);
+			result = TrialResult{ out, static_cast<uint32_t>(outsize), SECTOR_FMT_DEFLATE };
 		}
-		free(out);
+		free(zout);
 	}
 }
 
-void Sector::SevenZipTrial() {
+void Sector::SevenZipTrial(uint8_t *out, uint32_t cap, TrialResult &result) {
 #ifndef NO_DEFLATE7Z
-	uint8_t *result = pool.Alloc();
 	uint32_t resultSize = 0;
-	if (Deflate7z::Deflate(deflate7z_, result, pool.bufferSize, buffer_, blockSize_, &resultSize)) {
-		SubmitTrial(result, resultSize, SECTOR_FMT_DEFLATE);
-	} else {
-		pool.Release(result);
+	Deflate7z::Context *ctx = WorkerPool::ThreadCodecs()->SevenZip((flags_ & TASKFLAG_FMT_DAX) != 0);
+	if (ctx != nullptr && Deflate7z::Deflate(ctx, out, cap, buffer_, blockSize_, &resultSize)) {
+		result = TrialResult{ out, resultSize, SECTOR_FMT_DEFLATE };
 	}
 #endif
 }
 
-void Sector::LibDeflateTrial() {
-	uint8_t *result = pool.Alloc();
+void Sector::LibDeflateTrial(uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result) {
+	// libdeflate wants a few bytes of padding at the end, or it fails even when the result fits.
+	const uint32_t padded = std::min(cap + 8, outSize);
+	libdeflate_compressor *compressor = WorkerPool::ThreadCodecs()->LibDeflate();
+	if (compressor == nullptr) {
+		return;
+	}
+
 	size_t resultSize;
 	if (flags_ & TASKFLAG_FMT_DAX) {
-		resultSize = libdeflate_zlib_compress(libdeflate_, buffer_, blockSize_, result, pool.bufferSize);
+		resultSize = libdeflate_zlib_compress(compressor, buffer_, blockSize_, out, padded);
 	} else {
-		resultSize = libdeflate_deflate_compress(libdeflate_, buffer_, blockSize_, result, pool.bufferSize);
+		resultSize = libdeflate_deflate_compress(compressor, buffer_, blockSize_, out, padded);
 	}
 
-	if (resultSize != 0) {
-		SubmitTrial(result, static_cast<uint32_t>(resultSize), SECTOR_FMT_DEFLATE);
-	} else {
-		pool.Release(result);
+	if (resultSize != 0 && resultSize <= cap) {
+		result = TrialResult{ out, static_cast<uint32_t>(resultSize), SECTOR_FMT_DEFLATE };
 	}
 }
 
-void Sector::LZ4HCTrial(bool allowBrute) {
-	// Sometimes lower levels can actually win.  But, usually not, so only try a few.
-	int level = allowBrute ? 4 : 16;
-	for (; level <= 16; level += 3) {
-		uint8_t *result = pool.Alloc();
-		uint32_t resultSize = LZ4_compress_HC(reinterpret_cast<const char *>(buffer_), reinterpret_cast<char *>(result), blockSize_, pool.bufferSize, level);
-		if (resultSize != 0) {
-			SubmitTrial(result, resultSize, SECTOR_FMT_LZ4);
-		} else {
-			pool.Release(result);
-		}
+void Sector::LZ4HCTrial(int level, uint8_t *out, uint32_t cap, TrialResult &result) {
+	uint32_t resultSize = LZ4_compress_HC(reinterpret_cast<const char *>(buffer_), reinterpret_cast<char *>(out), blockSize_, cap, level);
+	if (resultSize != 0) {
+		result = TrialResult{ out, resultSize, SECTOR_FMT_LZ4 };
 	}
 }
 
-void Sector::LZ4Trial() {
-	uint8_t *result = pool.Alloc();
-	uint32_t resultSize = LZ4_compress_default(reinterpret_cast<const char *>(buffer_), reinterpret_cast<char *>(result), blockSize_, pool.bufferSize);
+void Sector::LZ4Trial(uint8_t *out, uint32_t cap, TrialResult &result) {
+	uint32_t resultSize = LZ4_compress_default(reinterpret_cast<const char *>(buffer_), reinterpret_cast<char *>(out), blockSize_, cap);
 	if (resultSize != 0) {
-		SubmitTrial(result, resultSize, SECTOR_FMT_LZ4);
-	} else {
-		pool.Release(result);
+		result = TrialResult{ out, resultSize, SECTOR_FMT_LZ4 };
 	}
 }
 
-// Frees result if it's not better (takes ownership.)
-bool Sector::SubmitTrial(uint8_t *result, uint32_t size, SectorFormat fmt) {
+// Only tracks the best size and format, the caller keeps the winning buffer.
+bool Sector::SubmitTrial(uint32_t size, SectorFormat fmt) {
 	bool better = size + origMaxCost_ < bestSize_;
 
 	if (flags_ & TASKFLAG_FMT_DAX) {
@@ -307,16 +683,9 @@ bool Sector::SubmitTrial(uint8_t *result, uint32_t size, SectorFormat fmt) {
 
 	if (better) {
 		bestSize_ = size;
-		if (best_) {
-			pool.Release(best_);
-		}
-		best_ = result;
 		bestFmt_ = fmt;
-		return true;
-	} else {
-		pool.Release(result);
-		return false;
 	}
+	return better;
 }
 
 void Sector::Release() {
@@ -325,14 +694,25 @@ void Sector::Release() {
 		best_ = nullptr;
 	}
 	if (buffer_ != nullptr) {
-		pool.Release(buffer_);
+		if (!bufferMapped_) {
+			pool.Release(buffer_);
+		}
 		buffer_ = nullptr;
+		bufferMapped_ = false;
 	}
 
 	busy_ = false;
-	enqueued_ = false;
 	compress_ = true;
-	readySize_ = 0;
+	skipped_ = false;
+	filled_ = false;
+	fillByte_ = -1;
+	cached_ = false;
+	hashed_ = false;
+	known_.clear();
+	knownChanged_ = false;
+	knownUsed_ = 0;
+	pruned_ = 0;
+	ResetTrialStats();
 }
 
 };
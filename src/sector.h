@@ -4,22 +4,27 @@
 #include <functional>
 #include <vector>
 #include "uv_helper.h"
+#include "block_cache.h"
+#include "compress.h"
+#include "cso.h"
+#include "trial_cache.h"
+#include "trial_pruner.h"
+#include "worker_pool.h"
 
 typedef struct z_stream_s z_stream;
-typedef struct libdeflate_compressor libdeflate_compressor;
-
-namespace Deflate7z {
-	struct Context;
-};
 
 namespace maxcso {
 
 typedef std::function<void (bool status, const char *reason)> SectorCallback;
 
-enum SectorFormat {
-	SECTOR_FMT_ORIG,
-	SECTOR_FMT_DEFLATE,
-	SECTOR_FMT_LZ4,
+// The best result for a block filled with a single byte value.
+// These are very common (padding, dummy files), and always compress the same way.
+struct FillResult {
+	bool known;
+	// False if trials were pruned, so a block that runs them all should replace it.
+	bool complete;
+	SectorFormat fmt;
+	std::vector<uint8_t> data;
 };
 
 // Actually block.
@@ -28,15 +33,23 @@ class Sector {
 	Sector(uint32_t flags);
 	~Sector();
 
-	void Setup(uv_loop_t *loop, uint32_t blockSize, uint32_t align, uint32_t origMaxCost, uint32_t lz4MaxCost) {
-		loop_ = loop;
+	// Fills should have 256 entries, one for each byte value, and is only used on the loop thread.
+	// The caches are optional, and shared with other tasks.  The pruner is optional, and per task.
+	void Setup(WorkerPool *workers, uint32_t blockSize, uint32_t align, uint32_t origMaxCost, uint32_t lz4MaxCost, double entropyThreshold, FillResult *fills, BlockCache *cache, TrialCache *trialCache, TrialPruner *pruner) {
+		workers_ = workers;
 		blockSize_ = blockSize;
 		align_ = align;
 		origMaxCost_ = origMaxCost;
 		lz4MaxCost_ = lz4MaxCost;
+		entropyThreshold_ = entropyThreshold;
+		fills_ = fills;
+		cache_ = cache != nullptr && cache->Enabled() ? cache : nullptr;
+		trialCache_ = trialCache != nullptr && trialCache->Enabled() ? trialCache : nullptr;
+		pruner_ = pruner;
 	}
 
-	void Process(int64_t pos, uint8_t *buffer, SectorCallback ready);
+	// If mapped, buffer belongs to Input and is only read.
+	void Process(int64_t pos, uint8_t *buffer, bool mapped, SectorCallback ready);
 	// Call after Process() or Release().
 	void Release();
 	void DisableCompress() {
@@ -58,12 +71,23 @@ class Sector {
 	SectorFormat Format() {
 		return bestFmt_;
 	}
-
-	// Just so it has some place to live.
-	// Otherwise, Output needs to handle a list of these.
-	uv_fs_t *WriteReq() {
-		return &write_;
+	// Whether trials were skipped because the block looked incompressible.
+	bool Skipped() {
+		return skipped_;
+	}
+	// Whether an earlier result for the same fill byte was reused.
+	bool Filled() {
+		return filled_;
 	}
+	// Whether the result came from the cache of earlier blocks.
+	bool Cached() {
+		return cached_;
+	}
+	// How many trials were loaded from the trial cache, instead of run.
+	uint32_t KnownTrialsUsed() {
+		return knownUsed_;
+	}
+	void GetStats(BlockStats &stats);
 
 private:
 	uint32_t AlignedBestSize(uint32_t align) {
@@ -74,43 +98,97 @@ class Sector {
 		return bestSize_;
 	}
 
+	struct TrialResult {
+		uint8_t *buffer;
+		uint32_t size;
+		SectorFormat fmt;
+	};
+
+	bool UseFill();
+	void RememberFill();
+	void HashBlock();
+	bool LookupCache();
+	void Remember();
+	TrialCache::Key KnownTrialsKey();
+	void LoadKnownTrials();
+	bool HasKnownTrial(TrialMethod method);
+	// Copies into out when found.
+	bool UseKnownTrial(TrialMethod method, uint8_t *out, uint32_t outSize, TrialResult &result);
+	void AddKnownTrial(TrialMethod method, const TrialResult &result);
+	void SaveKnownTrials();
+	bool LooksIncompressible();
 	void Compress();
+	void CompressSplit();
+	void FinishSplit();
 	void FinalizeBest(uint32_t align);
-	void ZlibTrial(z_stream *z);
-	void ZopfliTrial();
-	void SevenZipTrial();
-	void LibDeflateTrial();
-	void LZ4HCTrial(bool allowBrute);
-	void LZ4Trial();
-	bool SubmitTrial(uint8_t *result, uint32_t size, SectorFormat fmt);
-
-	UVHelper uv_;
-	uv_loop_t *loop_;
+	void ResetTrialStats();
+	bool Pruned(TrialMethod method) {
+		return (pruned_ & (1 << method)) != 0;
+	}
+	// Never more than outSize, the size of the buffer the trial writes to.
+	uint32_t TrialCap(TrialMethod method, uint32_t outSize, const TrialResult *results);
+	// Writes to out (outSize bytes), which the caller owns.  Results larger than cap are thrown away (and usually stop early.)
+	void RunTrial(TrialMethod method, uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result);
+	void ZlibTrial(z_stream *z, uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result);
+	void ZopfliTrial(uint8_t *out, uint32_t cap, TrialResult &result);
+	void SevenZipTrial(uint8_t *out, uint32_t cap, TrialResult &result);
+	void LibDeflateTrial(uint8_t *out, uint32_t outSize, uint32_t cap, TrialResult &result);
+	void LZ4HCTrial(int level, uint8_t *out, uint32_t cap, TrialResult &result);
+	void LZ4Trial(uint8_t *out, uint32_t cap, TrialResult &result);
+	bool SubmitTrial(uint32_t size, SectorFormat fmt);
+
+	WorkerPool *workers_;
 	uint32_t flags_;
 	uint32_t align_;
 	uint32_t origMaxCost_ = 0;
 	uint32_t lz4MaxCost_ = 0;
+	double entropyThreshold_ = 8.0;
 	bool busy_ = false;
-	bool enqueued_ = false;
 	bool compress_ = true;
+	bool skipped_ = false;
+	bool filled_ = false;
+	// Only when the whole block is one byte value, -1 otherwise.
+	int fillByte_ = -1;
+	FillResult *fills_ = nullptr;
+	bool cached_ = false;
+	BlockCache *cache_ = nullptr;
+	BlockCache::Key cacheKey_;
+	bool hashed_ = false;
+	TrialCache *trialCache_ = nullptr;
+	// Trial results for this block from the trial cache, and any new ones to save.
+	std::vector<KnownTrial> known_;
+	bool knownChanged_ = false;
+	uint32_t knownUsed_ = 0;
 
 	uint32_t blockSize_;
-	uint32_t readySize_ = 0;
 
 	int64_t pos_;
 	uint8_t *buffer_ = nullptr;
+	bool bufferMapped_ = false;
 	uint8_t *best_ = nullptr;
 	uint32_t bestSize_;
 	SectorFormat bestFmt_;
 
 	uv_work_t work_;
-	uv_fs_t write_;
 
 	SectorCallback ready_;
 
-	std::vector<z_stream *> zStreams_;
-	Deflate7z::Context *deflate7z_ = nullptr;
-	libdeflate_compressor *libdeflate_ = nullptr;
+	std::vector<TrialMethod> trials_;
+	// The same trials, cheapest first.
+	std::vector<TrialMethod> runOrder_;
+	// Only used with TASKFLAG_SPLIT_TRIALS, one per trial.
+	std::vector<uv_work_t> trialWork_;
+	std::vector<TrialResult> trialResults_;
+	size_t trialsLeft_ = 0;
+	bool trialFailed_ = false;
+
+	TrialPruner *pruner_ = nullptr;
+	uint32_t pruned_ = 0;
+
+	// For stats.  Each trial only writes its own entry, so split trials don't conflict.
+	int bestMethod_ = -1;
+	int32_t trialSizes_[TRIAL_METHOD_COUNT];
+	uint64_t trialNs_[TRIAL_METHOD_COUNT];
 };
 
 };
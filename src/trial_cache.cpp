@@ -0,0 +1,307 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/file.h>
+#endif
+#include "trial_cache.h"
+#include "uv_helper.h"
+
+namespace maxcso {
+
+// Bump this when any trial's settings change, so old results are discarded.
+static const uint32_t TRIAL_CACHE_VERSION = 1;
+static const char TRIAL_CACHE_MAGIC[8] = { 'M', 'X', 'T', 'R', 'I', 'A', 'L', 'S' };
+
+// TODO: Endian-ify?
+struct TrialCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t unused;
+};
+
+// Followed by count entries, and then the data for each in order.
+struct TrialRecordHeader {
+	uint64_t hash[2];
+	uint32_t blockSize;
+	uint32_t variant;
+	uint32_t count;
+	uint32_t dataSize;
+};
+
+struct TrialRecordEntry {
+	uint32_t method;
+	uint32_t size;
+};
+
+// Other runs may share the directory, so anything that writes or scans a shard holds this.
+static bool LockShardFile(uv_file file) {
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+	return LockFileEx(reinterpret_cast<HANDLE>(_get_osfhandle(file)), LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+	int result;
+	do {
+		result = flock(file, LOCK_EX);
+	} while (result < 0 && errno == EINTR);
+	return result == 0;
+#endif
+}
+
+static void UnlockShardFile(uv_file file) {
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+	UnlockFileEx(reinterpret_cast<HANDLE>(_get_osfhandle(file)), 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+	flock(file, LOCK_UN);
+#endif
+}
+
+static uint64_t RecordSize(const TrialRecordHeader &record) {
+	return sizeof(record) + static_cast<uint64_t>(record.count) * sizeof(TrialRecordEntry) + record.dataSize;
+}
+
+bool TrialCache::Key::operator ==(const Key &other) const {
+	return hash[0] == other.hash[0] && hash[1] == other.hash[1] && blockSize == other.blockSize && variant == other.variant;
+}
+
+TrialCache::TrialCache(uv_loop_t *loop) : loop_(loop) {
+	for (Shard &shard : shards_) {
+		uv_mutex_init(&shard.mutex);
+	}
+}
+
+TrialCache::~TrialCache() {
+	for (Shard &shard : shards_) {
+		if (shard.file >= 0) {
+			uv_fs_t req;
+			uv_fs_close(loop_, &req, shard.file, nullptr);
+			uv_fs_req_cleanup(&req);
+		}
+		uv_mutex_destroy(&shard.mutex);
+	}
+}
+
+bool TrialCache::Open(const std::string &dir) {
+	uv_fs_t req;
+	int result = uv_fs_mkdir(loop_, &req, dir.c_str(), 0755, nullptr);
+	uv_fs_req_cleanup(&req);
+	if (result < 0 && result != UV_EEXIST) {
+		return false;
+	}
+
+	result = uv_fs_stat(loop_, &req, dir.c_str(), nullptr);
+	const bool isDir = result == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+	uv_fs_req_cleanup(&req);
+	if (!isDir) {
+		return false;
+	}
+
+	dir_ = dir;
+	return true;
+}
+
+bool TrialCache::ReadAt(uv_file file, void *p, uint32_t size, int64_t pos) {
+	uv_fs_t req;
+	uv_buf_t buf = uv_buf_init(static_cast<char *>(p), size);
+	int result = uv_fs_read(loop_, &req, file, &buf, 1, pos, nullptr);
+	uv_fs_req_cleanup(&req);
+	return result == static_cast<int>(size);
+}
+
+bool TrialCache::WriteAt(uv_file file, const void *p, uint32_t size, int64_t pos) {
+	uv_fs_t req;
+	uv_buf_t buf = uv_buf_init(const_cast<char *>(static_cast<const char *>(p)), size);
+	int result = uv_fs_write(loop_, &req, file, &buf, 1, pos, nullptr);
+	uv_fs_req_cleanup(&req);
+	return result == static_cast<int>(size);
+}
+
+int64_t TrialCache::FileSize(uv_file file) {
+	uv_fs_t req;
+	int result = uv_fs_fstat(loop_, &req, file, nullptr);
+	const int64_t size = result < 0 ? -1 : static_cast<int64_t>(req.statbuf.st_size);
+	uv_fs_req_cleanup(&req);
+	return size;
+}
+
+bool TrialCache::ValidHeader(uv_file file) {
+	TrialCacheHeader header;
+	return ReadAt(file, &header, sizeof(header), 0) && memcmp(header.magic, TRIAL_CACHE_MAGIC, sizeof(header.magic)) == 0 && header.version == TRIAL_CACHE_VERSION;
+}
+
+int64_t TrialCache::ScanRecords(Shard &shard, int64_t pos, int64_t size) {
+	// Later records for the same key replace earlier ones.
+	TrialRecordHeader record;
+	while (pos + static_cast<int64_t>(sizeof(record)) <= size && ReadAt(shard.file, &record, sizeof(record), pos)) {
+		const uint64_t recordSize = RecordSize(record);
+		if (pos + static_cast<int64_t>(recordSize) > size || recordSize > 0xFFFFFFFF) {
+			break;
+		}
+		const Key key = { { record.hash[0], record.hash[1] }, record.blockSize, record.variant };
+		shard.index[key] = Location{ pos, static_cast<uint32_t>(recordSize) };
+		pos += recordSize;
+	}
+	// Anything after pos was cut short (i.e. killed while writing), and is dropped before the next write.
+	return pos;
+}
+
+void TrialCache::LoadShard(Shard &shard) {
+	shard.loaded = true;
+
+	char name[32];
+	snprintf(name, sizeof(name), "/trials-%02x.bin", static_cast<unsigned>(&shard - shards_));
+	const std::string path = dir_ + name;
+
+	uv_fs_t req;
+	int file = uv_fs_open(loop_, &req, path.c_str(), O_RDWR | O_CREAT, 0644, nullptr);
+	uv_fs_req_cleanup(&req);
+	if (file < 0) {
+		return;
+	}
+	if (!LockShardFile(file)) {
+		uv_fs_close(loop_, &req, file, nullptr);
+		uv_fs_req_cleanup(&req);
+		return;
+	}
+	shard.file = file;
+
+	const int64_t size = FileSize(file);
+	TrialCacheHeader header;
+	int64_t pos = sizeof(header);
+	if (size < pos || !ValidHeader(file)) {
+		// New or from a different version.  Start over.
+		memcpy(header.magic, TRIAL_CACHE_MAGIC, sizeof(header.magic));
+		header.version = TRIAL_CACHE_VERSION;
+		header.unused = 0;
+		const bool reset = uv_fs_ftruncate(loop_, &req, file, 0, nullptr) == 0 && WriteAt(file, &header, sizeof(header), 0);
+		uv_fs_req_cleanup(&req);
+		if (!reset) {
+			UnlockShardFile(file);
+			uv_fs_close(loop_, &req, file, nullptr);
+			uv_fs_req_cleanup(&req);
+			shard.file = -1;
+			return;
+		}
+	} else {
+		pos = ScanRecords(shard, pos, size);
+	}
+
+	UnlockShardFile(file);
+	shard.end = pos;
+}
+
+bool TrialCache::Load(const Key &key, std::vector<KnownTrial> &trials) {
+	Shard &shard = ShardFor(key);
+	Location loc;
+	uv_file file;
+	{
+		Guard g(shard.mutex);
+		if (!shard.loaded) {
+			LoadShard(shard);
+		}
+		auto it = shard.index.find(key);
+		if (it == shard.index.end()) {
+			return false;
+		}
+		loc = it->second;
+		file = shard.file;
+	}
+
+	// Records are never modified once written, so we can read without the lock.
+	// Another run may have started the file over though, so check it's still the right record.
+	std::vector<uint8_t> record(loc.size);
+	if (loc.size < sizeof(TrialRecordHeader) || !ReadAt(file, record.data(), loc.size, loc.pos)) {
+		return false;
+	}
+
+	const TrialRecordHeader *header = reinterpret_cast<const TrialRecordHeader *>(record.data());
+	const Key found = { { header->hash[0], header->hash[1] }, header->blockSize, header->variant };
+	if (!(found == key) || RecordSize(*header) != loc.size) {
+		return false;
+	}
+	const TrialRecordEntry *entries = reinterpret_cast<const TrialRecordEntry *>(header + 1);
+	const uint8_t *data = reinterpret_cast<const uint8_t *>(entries + header->count);
+	const uint8_t *dataEnd = record.data() + record.size();
+
+	trials.clear();
+	for (uint32_t i = 0; i < header->count; ++i) {
+		if (entries[i].size > static_cast<size_t>(dataEnd - data)) {
+			trials.clear();
+			return false;
+		}
+		trials.push_back(KnownTrial{ entries[i].method, std::vector<uint8_t>(data, data + entries[i].size) });
+		data += entries[i].size;
+	}
+	return true;
+}
+
+void TrialCache::Store(const Key &key, const std::vector<KnownTrial> &trials) {
+	TrialRecordHeader header;
+	header.hash[0] = key.hash[0];
+	header.hash[1] = key.hash[1];
+	header.blockSize = key.blockSize;
+	header.variant = key.variant;
+	header.count = static_cast<uint32_t>(trials.size());
+	header.dataSize = 0;
+	for (const KnownTrial &trial : trials) {
+		header.dataSize += static_cast<uint32_t>(trial.data.size());
+	}
+
+	// Build the whole record, so it's written in one go.
+	std::vector<uint8_t> record(sizeof(header) + trials.size() * sizeof(TrialRecordEntry) + header.dataSize);
+	memcpy(record.data(), &header, sizeof(header));
+	TrialRecordEntry *entries = reinterpret_cast<TrialRecordEntry *>(record.data() + sizeof(header));
+	uint8_t *data = reinterpret_cast<uint8_t *>(entries + trials.size());
+	for (size_t i = 0; i < trials.size(); ++i) {
+		entries[i].method = trials[i].method;
+		entries[i].size = static_cast<uint32_t>(trials[i].data.size());
+		if (!trials[i].data.empty()) {
+			memcpy(data, trials[i].data.data(), trials[i].data.size());
+			data += trials[i].data.size();
+		}
+	}
+
+	Shard &shard = ShardFor(key);
+	Guard g(shard.mutex);
+	if (!shard.loaded) {
+		LoadShard(shard);
+	}
+	if (shard.file < 0) {
+		return;
+	}
+
+	if (!LockShardFile(shard.file)) {
+		return;
+	}
+
+	// Another run may have started the file over, perhaps for a different version.
+	if (!ValidHeader(shard.file)) {
+		UnlockShardFile(shard.file);
+		return;
+	}
+	// Pick up anything other runs appended since, so we write after it.
+	const int64_t fileSize = FileSize(shard.file);
+	if (fileSize < shard.end) {
+		shard.index.clear();
+		shard.end = sizeof(TrialCacheHeader);
+	}
+	shard.end = ScanRecords(shard, shard.end, fileSize);
+
+	uv_fs_t req;
+	const uint32_t size = static_cast<uint32_t>(record.size());
+	if (shard.end < fileSize) {
+		// Drop whatever was cut short, so it isn't mistaken for a record after ours.
+		uv_fs_ftruncate(loop_, &req, shard.file, shard.end, nullptr);
+		uv_fs_req_cleanup(&req);
+	}
+	if (WriteAt(shard.file, record.data(), size, shard.end)) {
+		shard.index[key] = Location{ shard.end, size };
+		shard.end += size;
+	}
+	UnlockShardFile(shard.file);
+}
+
+};
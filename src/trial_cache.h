@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "uv.h"
+
+namespace maxcso {
+
+// The output of one trial method for a block.  Empty data means the method failed.
+struct KnownTrial {
+	uint32_t method;
+	std::vector<uint8_t> data;
+};
+
+// Saves the output of each trial method to disk, so later runs only run the methods they're missing.
+// Costs and formats only change which result wins, so changing them doesn't require new trials.
+class TrialCache {
+public:
+	struct Key {
+		uint64_t hash[2];
+		uint32_t blockSize;
+		// Deflate output has a zlib header for DAX, so it's a different result.
+		uint32_t variant;
+
+		bool operator ==(const Key &other) const;
+	};
+
+	TrialCache(uv_loop_t *loop);
+	~TrialCache();
+
+	// Creates the directory if needed.  Until then, the cache is disabled.
+	bool Open(const std::string &dir);
+	bool Enabled() {
+		return !dir_.empty();
+	}
+
+	// Both are safe from any thread.  The cache is best effort, so I/O errors just mean a miss.
+	bool Load(const Key &key, std::vector<KnownTrial> &trials);
+	// Replaces any earlier record for the key, so should include all trials known.
+	void Store(const Key &key, const std::vector<KnownTrial> &trials);
+
+private:
+	struct KeyHasher {
+		size_t operator ()(const Key &key) const {
+			return static_cast<size_t>(key.hash[0]);
+		}
+	};
+	struct Location {
+		int64_t pos;
+		uint32_t size;
+	};
+	// Records are appended to one of these files, chosen by hash, and indexed in memory.
+	// Other runs may append to the same files, so end is only a hint until the file is locked.
+	struct Shard {
+		uv_mutex_t mutex;
+		uv_file file = -1;
+		bool loaded = false;
+		int64_t end = 0;
+		std::unordered_map<Key, Location, KeyHasher> index;
+	};
+	static const int SHARDS = 256;
+
+	Shard &ShardFor(const Key &key) {
+		return shards_[key.hash[0] >> 56];
+	}
+	// Call with the shard locked.
+	void LoadShard(Shard &shard);
+	// Indexes complete records from pos up to size, and returns where they end.
+	int64_t ScanRecords(Shard &shard, int64_t pos, int64_t size);
+	bool ValidHeader(uv_file file);
+	int64_t FileSize(uv_file file);
+	bool ReadAt(uv_file file, void *p, uint32_t size, int64_t pos);
+	bool WriteAt(uv_file file, const void *p, uint32_t size, int64_t pos);
+
+	uv_loop_t *loop_;
+	std::string dir_;
+	Shard shards_[SHARDS];
+};
+
+};
@@ -0,0 +1,78 @@
+#include "trial_pruner.h"
+
+namespace maxcso {
+
+// How many blocks (that a method ran on) to consider.
+static const size_t WINDOW_SIZE = 128;
+// Don't prune until we've seen this many, since early blocks (i.e. headers) may be unusual.
+static const size_t MIN_SAMPLES = 64;
+// Methods that win fewer than 1 in this many blocks are rare.
+static const size_t RARE_WIN_RATE = 50;
+// Rare methods still run on 1 in this many blocks, so we notice if they start winning.
+static const uint32_t SAMPLE_RATE = 8;
+
+TrialPruner::TrialPruner() {
+	for (Window &window : windows_) {
+		window.wins.resize(WINDOW_SIZE);
+	}
+}
+
+bool TrialPruner::Rare(int method) {
+	const Window &window = windows_[method];
+	return window.count >= MIN_SAMPLES && window.winCount * RARE_WIN_RATE < window.count;
+}
+
+bool TrialPruner::NextIsSample() const {
+	return blocks_ % SAMPLE_RATE == 0;
+}
+
+uint32_t TrialPruner::NextSkipMask(const std::vector<TrialMethod> &trials) {
+	const bool sample = NextIsSample();
+	++blocks_;
+	if (sample) {
+		return 0;
+	}
+
+	uint32_t mask = 0;
+	// The first method always runs, so there's always something to compare against.
+	for (size_t i = 1; i < trials.size(); ++i) {
+		if (Rare(trials[i])) {
+			mask |= 1 << trials[i];
+		}
+	}
+	return mask;
+}
+
+void TrialPruner::Record(const int32_t *sizes, int winner) {
+	// Blocks left uncompressed don't tell us which method is better.
+	if (winner < 0) {
+		return;
+	}
+
+	// Only count a win if the block would've been larger without this method.
+	bool unique = true;
+	for (int m = 0; m < TRIAL_METHOD_COUNT && unique; ++m) {
+		if (m != winner && sizes[m] == sizes[winner]) {
+			unique = false;
+		}
+	}
+
+	for (int m = 0; m < TRIAL_METHOD_COUNT; ++m) {
+		if (sizes[m] < 0) {
+			continue;
+		}
+
+		Window &window = windows_[m];
+		const uint8_t won = unique && m == winner ? 1 : 0;
+		if (window.count == WINDOW_SIZE) {
+			window.winCount -= window.wins[window.pos];
+		} else {
+			++window.count;
+		}
+		window.wins[window.pos] = won;
+		window.winCount += won;
+		window.pos = (window.pos + 1) % WINDOW_SIZE;
+	}
+}
+
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "compress.h"
+
+namespace maxcso {
+
+// Tracks how often each method wins recently, so methods that rarely win can run less often.
+// They still run on a sample of blocks, so they come back if they start winning again.
+// Only used on the loop thread.
+class TrialPruner {
+public:
+	TrialPruner();
+
+	// Returns a mask of (1 << TrialMethod) to leave out of the next block.
+	uint32_t NextSkipMask(const std::vector<TrialMethod> &trials);
+	// Whether the next block will be a sample, which leaves nothing out.
+	bool NextIsSample() const;
+	// Sizes are per method, and -1 for methods that didn't run.
+	void Record(const int32_t *sizes, int winner);
+
+private:
+	bool Rare(int method);
+
+	struct Window {
+		// Ring buffer of whether this method won, for the last blocks it ran on.
+		std::vector<uint8_t> wins;
+		size_t pos = 0;
+		size_t count = 0;
+		size_t winCount = 0;
+	};
+
+	Window windows_[TRIAL_METHOD_COUNT];
+	uint32_t blocks_ = 0;
+};
+
+};
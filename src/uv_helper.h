@@ -27,6 +27,15 @@ struct Guard {
 	uv_mutex_t &mutex_;
 };
 
+// A handle's memory must last until its close callback, which runs on a later loop iteration.
+// So handles owned by objects that may be gone by then are allocated, and freed once closed.
+template <typename T>
+inline void CloseAndDelete(T *handle) {
+	uv_close(reinterpret_cast<uv_handle_t *>(handle), [](uv_handle_t *h) {
+		delete reinterpret_cast<T *>(h);
+	});
+}
+
 class UVHelper {
 public:
 	UVHelper() {
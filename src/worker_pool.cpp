@@ -0,0 +1,124 @@
+#include "worker_pool.h"
+#include "codecs.h"
+
+namespace maxcso {
+
+static thread_local Codecs *threadCodecs = nullptr;
+
+WorkerPool::WorkerPool(uv_loop_t *loop) : loop_(loop) {
+	uv_mutex_init(&mutex_);
+	uv_cond_init(&cond_);
+	async_ = new uv_async_t;
+	uv_async_init(loop_, async_, [](uv_async_t *handle) {
+		static_cast<WorkerPool *>(handle->data)->HandleDone();
+	});
+	async_->data = this;
+	// Only keep the loop alive when there's work pending.
+	uv_unref(reinterpret_cast<uv_handle_t *>(async_));
+}
+
+WorkerPool::~WorkerPool() {
+	Stop();
+	CloseAndDelete(async_);
+	uv_cond_destroy(&cond_);
+	uv_mutex_destroy(&mutex_);
+}
+
+void WorkerPool::Start(int threads) {
+	if (threads < 1) {
+		uv_cpu_info_t *cpus;
+		uv_cpu_info(&cpus, &threads);
+		uv_free_cpu_info(cpus, threads);
+		if (threads < 1) {
+			threads = 1;
+		}
+	}
+
+	threads_.resize(threads);
+	for (uv_thread_t &thread : threads_) {
+		uv_thread_create(&thread, &ThreadMain, this);
+	}
+}
+
+void WorkerPool::Stop() {
+	{
+		Guard g(mutex_);
+		stopping_ = true;
+		uv_cond_broadcast(&cond_);
+	}
+	for (uv_thread_t &thread : threads_) {
+		uv_thread_join(&thread);
+	}
+	threads_.clear();
+}
+
+int WorkerPool::queue_work(uv_work_t *req, work_func_cb &&work, after_work_func_cb &&after) {
+	if (threads_.empty()) {
+		return UV_EINVAL;
+	}
+
+	if (pending_++ == 0) {
+		uv_ref(reinterpret_cast<uv_handle_t *>(async_));
+	}
+
+	Guard g(mutex_);
+	queue_.push_back(Job{ req, std::move(work), std::move(after) });
+	uv_cond_signal(&cond_);
+	return 0;
+}
+
+void WorkerPool::ThreadMain(void *arg) {
+	static_cast<WorkerPool *>(arg)->Run();
+}
+
+Codecs *WorkerPool::ThreadCodecs() {
+	return threadCodecs;
+}
+
+void WorkerPool::Run() {
+	// Lives as long as the thread, and reused for every job on it.
+	Codecs codecs;
+	threadCodecs = &codecs;
+
+	uv_mutex_lock(&mutex_);
+	for (;;) {
+		while (queue_.empty() && !stopping_) {
+			uv_cond_wait(&cond_, &mutex_);
+		}
+		if (queue_.empty()) {
+			break;
+		}
+
+		Job job = std::move(queue_.front());
+		queue_.pop_front();
+		uv_mutex_unlock(&mutex_);
+
+		job.work(job.req);
+
+		uv_mutex_lock(&mutex_);
+		done_.push_back(std::move(job));
+		uv_async_send(async_);
+	}
+	uv_mutex_unlock(&mutex_);
+
+	threadCodecs = nullptr;
+}
+
+void WorkerPool::HandleDone() {
+	std::vector<Job> done;
+	{
+		Guard g(mutex_);
+		done.swap(done_);
+	}
+
+	for (Job &job : done) {
+		job.after(job.req, 0);
+	}
+
+	pending_ -= done.size();
+	if (pending_ == 0 && !done.empty()) {
+		uv_unref(reinterpret_cast<uv_handle_t *>(async_));
+	}
+}
+
+};
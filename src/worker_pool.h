@@ -0,0 +1,61 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include "uv_helper.h"
+
+namespace maxcso {
+
+class Codecs;
+
+// Threads for CPU heavy work, like compression trials.
+// This is separate from the libuv threadpool, which is left for file I/O.  That way, reads and
+// writes never wait behind a slow block, which would stall the whole pipeline.
+class WorkerPool {
+public:
+	WorkerPool(uv_loop_t *loop);
+	~WorkerPool();
+
+	// Must be called before any work is queued.
+	void Start(int threads);
+	// Waits for all queued work to finish and stops the threads.  Call from the loop thread.
+	void Stop();
+
+	// Just like uv_queue_work(): work runs on a worker thread, and after on the loop thread.
+	// Must be called from the loop thread.
+	int queue_work(uv_work_t *req, work_func_cb &&work, after_work_func_cb &&after);
+	size_t Threads() {
+		return threads_.size();
+	}
+
+	// Compressor state for the current thread, so it scales with threads rather than blocks.
+	// Only valid inside work.
+	static Codecs *ThreadCodecs();
+
+private:
+	struct Job {
+		uv_work_t *req;
+		work_func_cb work;
+		after_work_func_cb after;
+	};
+
+	static void ThreadMain(void *arg);
+	void Run();
+	void HandleDone();
+
+	uv_loop_t *loop_;
+	uv_async_t *async_;
+	uv_mutex_t mutex_;
+	uv_cond_t cond_;
+	std::vector<uv_thread_t> threads_;
+
+	// Protected by mutex_.
+	std::deque<Job> queue_;
+	std::vector<Job> done_;
+	bool stopping_ = false;
+
+	// Only touched on the loop thread.  While non-zero, we keep the loop alive.
+	size_t pending_ = 0;
+};
+
+};
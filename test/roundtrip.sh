@@ -0,0 +1,75 @@
+#!/bin/sh
+# Compresses test ISOs with various options, decompresses them again, and checks they match.
+# Usage: roundtrip.sh path/to/maxcso
+
+MAXCSO=${1:-./maxcso}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+# Half random, half text, so blocks go both ways.
+make_iso() {
+	head -c $(($2 / 2)) /dev/urandom > "$1"
+	yes 'maxcso roundtrip test data' | head -c $(($2 / 2)) >> "$1"
+}
+
+# Args: name, iso, then options for compressing.
+check() {
+	name=$1
+	iso=$2
+	shift 2
+	if ! "$MAXCSO" --quiet "$@" "$iso" -o "$TMP/out.cso"; then
+		echo "FAIL: $name (compress)"
+		FAILED=1
+	elif ! "$MAXCSO" --quiet --decompress "$TMP/out.cso" -o "$TMP/out.iso"; then
+		echo "FAIL: $name (decompress)"
+		FAILED=1
+	elif ! cmp -s "$iso" "$TMP/out.iso"; then
+		echo "FAIL: $name (mismatch)"
+		FAILED=1
+	else
+		echo "ok: $name"
+	fi
+	rm -f "$TMP/out.cso" "$TMP/out.iso"
+}
+
+# Prints the CRC of the (decompressed) data, or nothing if it failed.
+crc_of() {
+	"$MAXCSO" --crc "$1" 2>&1 | tr '\r' '\n' | grep 'CRC32:' | sed 's/.*CRC32: //'
+}
+
+# Like check, but compares CRCs instead of writing out the whole ISO again.
+check_crc() {
+	name=$1
+	iso=$2
+	shift 2
+	expected=$(crc_of "$iso")
+	if ! "$MAXCSO" --quiet "$@" "$iso" -o "$TMP/out.cso"; then
+		echo "FAIL: $name (compress)"
+		FAILED=1
+	elif [ -z "$expected" ] || [ "$(crc_of "$TMP/out.cso")" != "$expected" ]; then
+		echo "FAIL: $name (mismatch)"
+		FAILED=1
+	else
+		echo "ok: $name"
+	fi
+	rm -f "$TMP/out.cso"
+}
+
+make_iso "$TMP/small.iso" 8388608
+
+# ISO reads use one buffer per block, and only so many fit in one read.
+check "read size 3000 KB" "$TMP/small.iso" --read-size=3000
+check "read size 4096 KB" "$TMP/small.iso" --read-size=4096
+check "read size 4096 KB, io_uring" "$TMP/small.iso" --read-size=4096 --io-uring
+check "read size 8192 KB, 16 KB blocks" "$TMP/small.iso" --read-size=8192 --block=16384
+
+# Over 8 GB, so the index is shifted by 3.  With an even number of blocks, the header and index
+# don't end aligned to that.
+# Sparse, so it takes almost no space (or time to read.)
+make_iso "$TMP/large.iso" 1048576
+truncate -s $((8 * 1024 * 1024 * 1024 + 32768)) "$TMP/large.iso"
+check_crc "shifted index, cso1" "$TMP/large.iso"
+check_crc "shifted index, zso" "$TMP/large.iso" --format=zso
+
+exit $FAILED